@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+/*
+  Micro-benchmarks run against a mounted filesystem through ordinary
+  system calls. Every operation is timed on its own; each benchmark then
+  prints one line of key=value pairs with its throughput and latency
+  percentiles, so the output can be compared between runs by a script.
+  bench.sh formats and mounts the images and runs this.
+*/
+
+#define SMALL_IO (4096)
+#define LARGE_IO (1 << 20)
+
+void print_usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-n <files>] [-s <file_mb>] [-r <readdirs>] <dir>\n", progname);
+    fprintf(stderr, "  -n  files created in one directory for the metadata benchmarks (default 1000)\n");
+    fprintf(stderr, "  -s  size in MB of the file used for the data benchmarks (default 16)\n");
+    fprintf(stderr, "  -r  full listings of the large directory (default 20)\n");
+    exit(EXIT_FAILURE);
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Latencies of one benchmark, in seconds
+struct samples {
+    double *lat;
+    size_t n, cap;
+    double start;
+};
+
+void samples_begin(struct samples *s, size_t cap) {
+    s->lat = malloc(cap * sizeof(*s->lat));
+    if (!s->lat) {
+        perror("Failed to allocate samples");
+        exit(EXIT_FAILURE);
+    }
+    s->n = 0;
+    s->cap = cap;
+    s->start = now();
+}
+
+void samples_add(struct samples *s, double t0) {
+    if (s->n < s->cap) {
+        s->lat[s->n++] = now() - t0;
+    }
+}
+
+int double_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(const struct samples *s, double p) {
+    size_t i = (size_t)(p * (s->n - 1) + 0.5);
+    return s->lat[i];
+}
+
+// Print one result line and release the samples. `bytes` is the size of each operation, 0 for metadata ones.
+void samples_report(struct samples *s, const char *name, size_t bytes) {
+    double total = now() - s->start;
+    qsort(s->lat, s->n, sizeof(*s->lat), double_cmp);
+    printf("bench=%s ops=%zu secs=%.6f ops_per_sec=%.1f", name, s->n, total, total > 0 ? s->n / total : 0.0);
+    if (bytes) {
+        printf(" mb_per_sec=%.1f", total > 0 ? s->n * (double)bytes / 1e6 / total : 0.0);
+    }
+    if (s->n) {
+        printf(" p50_us=%.1f p99_us=%.1f max_us=%.1f", percentile(s, 0.50) * 1e6, percentile(s, 0.99) * 1e6, s->lat[s->n - 1] * 1e6);
+    }
+    printf("\n");
+    fflush(stdout);
+    free(s->lat);
+}
+
+void fail(const char *what, const char *path) {
+    fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+void bench_create(const char *dir, int files) {
+    char path[4096];
+    struct samples s;
+    samples_begin(&s, files);
+    for (int i = 0; i < files; ++i) {
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        double t0 = now();
+        int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+        if (fd < 0) {
+            fail("Failed to create", path);
+        }
+        close(fd);
+        samples_add(&s, t0);
+    }
+    samples_report(&s, "create", 0);
+}
+
+void bench_stat(const char *dir, int files) {
+    char path[4096];
+    struct stat st;
+    struct samples s;
+    samples_begin(&s, files);
+    for (int i = 0; i < files; ++i) {
+        // Visit the names out of creation order so a lookup can't just continue where the last one ended
+        snprintf(path, sizeof(path), "%s/f%d", dir, (int)((i * 7919L) % files));
+        double t0 = now();
+        if (stat(path, &st) < 0) {
+            fail("Failed to stat", path);
+        }
+        samples_add(&s, t0);
+    }
+    samples_report(&s, "stat", 0);
+}
+
+void bench_readdir(const char *dir, int files, int rounds) {
+    struct samples s;
+    samples_begin(&s, rounds);
+    for (int r = 0; r < rounds; ++r) {
+        double t0 = now();
+        DIR *d = opendir(dir);
+        if (!d) {
+            fail("Failed to open directory", dir);
+        }
+        int seen = 0;
+        while (readdir(d)) {
+            ++seen;
+        }
+        closedir(d);
+        samples_add(&s, t0);
+        if (seen < files) {
+            fprintf(stderr, "Listed %d of %d entries in %s\n", seen, files, dir);
+            exit(EXIT_FAILURE);
+        }
+    }
+    samples_report(&s, "readdir", 0);
+}
+
+void bench_unlink(const char *dir, int files) {
+    char path[4096];
+    struct samples s;
+    samples_begin(&s, files);
+    for (int i = 0; i < files; ++i) {
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        double t0 = now();
+        if (unlink(path) < 0) {
+            fail("Failed to remove", path);
+        }
+        samples_add(&s, t0);
+    }
+    samples_report(&s, "unlink", 0);
+}
+
+// Read or write `size` bytes of the file in `io`-byte operations, in order or at random aligned offsets
+void bench_data(const char *path, const char *name, size_t size, size_t io, int write, int random) {
+    static char *buf;
+    if (!buf) {
+        if (!(buf = malloc(LARGE_IO))) {
+            perror("Failed to allocate buffer");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < LARGE_IO; ++i) {
+            buf[i] = (char)(i * 31 + 7);
+        }
+    }
+
+    int fd = open(path, write ? O_WRONLY | O_CREAT : O_RDONLY, 0644);
+    if (fd < 0) {
+        fail("Failed to open", path);
+    }
+    size_t ops = size / io;
+    struct samples s;
+    samples_begin(&s, ops);
+    for (size_t i = 0; i < ops; ++i) {
+        off_t off = (off_t)(random ? (size_t)rand() % ops : i) * io;
+        double t0 = now();
+        ssize_t n = write ? pwrite(fd, buf, io, off) : pread(fd, buf, io, off);
+        if (n != (ssize_t)io) {
+            fail(write ? "Failed to write" : "Failed to read", path);
+        }
+        samples_add(&s, t0);
+    }
+    if (write) {
+        // Count getting the data to the disks, not just into the daemon's cache
+        double t0 = now();
+        fsync(fd);
+        s.lat[s.n - 1] += now() - t0;
+    }
+    close(fd);
+    samples_report(&s, name, io);
+}
+
+int main(int argc, char *argv[]) {
+    int files = 1000, rounds = 20;
+    size_t file_mb = 16;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:r:")) != -1) {
+        switch (opt) {
+            case 'n':
+                files = atoi(optarg);
+                break;
+            case 's':
+                file_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || files <= 0 || file_mb == 0 || rounds <= 0) {
+        print_usage(argv[0]);
+    }
+
+    char dir[4096], data[4096];
+    snprintf(dir, sizeof(dir), "%s/bigdir", argv[optind]);
+    snprintf(data, sizeof(data), "%s/data", argv[optind]);
+    if (mkdir(dir, 0755) < 0) {
+        fail("Failed to create", dir);
+    }
+    srand(1);
+
+    bench_create(dir, files);
+    bench_stat(dir, files);
+    bench_readdir(dir, files, rounds);
+    bench_unlink(dir, files);
+
+    size_t size = file_mb << 20;
+    bench_data(data, "seq_write_1m", size, LARGE_IO, 1, 0);
+    bench_data(data, "seq_read_1m", size, LARGE_IO, 0, 0);
+    bench_data(data, "seq_write_4k", size, SMALL_IO, 1, 0);
+    bench_data(data, "seq_read_4k", size, SMALL_IO, 0, 0);
+    bench_data(data, "rand_write_4k", size, SMALL_IO, 1, 1);
+    bench_data(data, "rand_read_4k", size, SMALL_IO, 0, 1);
+
+    unlink(data);
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#!/bin/bash
+#
+# Format a set of disk images, mount them and run the micro-benchmarks,
+# writing one key=value line per benchmark to bench_output.txt.
+# Everything is configured through the environment:
+#
+#   DISKS=2          number of disk images
+#   DISK_MB=64       size of each image
+#   RAID=1           RAID mode given to mkfs
+#   MKFS_OPTS="-e -H" further mkfs options
+#   BLOCKS=          data blocks, by default 90% of a disk in 512-byte blocks
+#   WFS_OPTS=        options for the daemon, e.g. "-o io=uring"
+#   FILES=1000       files in the large directory
+#   FILE_MB=16       size of the file for the data benchmarks
+#   MKFS_RUNS=3      timed mkfs runs
+#   OUT=bench_output.txt
+#   WFS=./wfs        daemon to benchmark
+#   MKFS=./mkfs      mkfs to format and time with
+
+set -e
+
+DISKS=${DISKS:-2}
+DISK_MB=${DISK_MB:-64}
+RAID=${RAID:-1}
+MKFS_OPTS=${MKFS_OPTS:--e -H}
+BLOCKS=${BLOCKS:-$((DISK_MB * 1024 * 1024 / 512 * 9 / 10))}
+FILES=${FILES:-1000}
+FILE_MB=${FILE_MB:-16}
+MKFS_RUNS=${MKFS_RUNS:-3}
+OUT=${OUT:-bench_output.txt}
+WFS=${WFS:-./wfs}
+MKFS=${MKFS:-./mkfs}
+
+WORK=$(mktemp -d)
+MNT=$WORK/mnt
+mkdir "$MNT"
+trap 'mountpoint -q "$MNT" && fusermount -u "$MNT"; rm -rf "$WORK"' EXIT
+
+IMAGES=()
+DISK_ARGS=()
+for i in $(seq 1 "$DISKS"); do
+    IMAGES+=("$WORK/disk$i.img")
+    DISK_ARGS+=(-d "$WORK/disk$i.img")
+done
+
+echo "# disks=$DISKS disk_mb=$DISK_MB raid=$RAID mkfs_opts=\"$MKFS_OPTS\" wfs_opts=\"$WFS_OPTS\" blocks=$BLOCKS files=$FILES file_mb=$FILE_MB" > "$OUT"
+
+# mkfs wall time, over fresh images each run
+TIMES=()
+for run in $(seq 1 "$MKFS_RUNS"); do
+    for img in "${IMAGES[@]}"; do
+        rm -f "$img"
+        truncate -s "${DISK_MB}M" "$img"
+    done
+    start=$(date +%s%N)
+    "$MKFS" -r "$RAID" "${DISK_ARGS[@]}" -i $((FILES + 64)) -b "$BLOCKS" $MKFS_OPTS > /dev/null
+    TIMES+=($(( $(date +%s%N) - start )))
+done
+printf '%s\n' "${TIMES[@]}" | sort -n | awk '
+    { t[NR] = $1 / 1000; sum += $1 / 1e9 }
+    END {
+        printf "bench=mkfs ops=%d secs=%.6f ops_per_sec=%.1f p50_us=%.1f p99_us=%.1f max_us=%.1f\n",
+               NR, sum, NR / sum, t[int(0.50 * (NR - 1) + 1.5)], t[int(0.99 * (NR - 1) + 1.5)], t[NR]
+    }' >> "$OUT"
+
+"$WFS" "${IMAGES[@]}" $WFS_OPTS "$MNT"
+for i in $(seq 1 50); do
+    mountpoint -q "$MNT" && break
+    sleep 0.1
+done
+if ! mountpoint -q "$MNT"; then
+    echo "$WFS did not mount $MNT" >&2
+    exit 1
+fi
+./wfsbench -n "$FILES" -s "$FILE_MB" "$MNT" >> "$OUT"
+
+cat "$OUT"
@@ -0,0 +1,103 @@
+#include "bitmap.h"
+
+void bitmap_init(struct bitmap *bm, void *words, size_t num_bits) {
+    bm->words = words;
+    bm->num_bits = num_bits;
+    bm->cursors = 0;
+    bm->free = 0;
+}
+
+static unsigned int bitmap_load(const struct bitmap *bm, size_t word) {
+    return __atomic_load_n(&bm->words[word], __ATOMIC_RELAXED);
+}
+
+// Read 64-bit chunk `i`; bits past the end of the bitmap read as allocated
+static uint64_t bitmap_chunk(const struct bitmap *bm, size_t i) {
+    size_t first = i * 64;
+    uint64_t v = bitmap_load(bm, 2 * i);
+
+    if (first + 32 < bm->num_bits) {
+        v |= (uint64_t)bitmap_load(bm, 2 * i + 1) << 32;
+    }
+    if (bm->num_bits - first < 64) {
+        v |= ~0ULL << (bm->num_bits - first);
+    }
+    return v;
+}
+
+// Set a bit, returning 1 if this call is the one that set it
+static int bitmap_claim(struct bitmap *bm, size_t bit) {
+    unsigned int mask = 1U << (bit % 32);
+    if (__atomic_fetch_or(&bm->words[bit / 32], mask, __ATOMIC_ACQ_REL) & mask) {
+        return 0;
+    }
+    __atomic_sub_fetch(&bm->free, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+long bitmap_alloc_range(struct bitmap *bm, struct bitmap_cursor *cur, size_t start, size_t end) {
+    size_t first = start / 64;
+    size_t num_chunks = (end + 63) / 64 - first;
+
+    if (!cur->started || cur->chunk < first || cur->chunk - first >= num_chunks) {
+        unsigned int n = __atomic_fetch_add(&bm->cursors, 1, __ATOMIC_RELAXED);
+        cur->chunk = first + (n % BITMAP_REGIONS) * num_chunks / BITMAP_REGIONS;
+        cur->started = 1;
+    }
+
+    for (size_t n = 0; n < num_chunks; ++n) {
+        size_t i = cur->chunk + n;
+        if (i >= first + num_chunks) {
+            i -= num_chunks;
+        }
+
+        // Another thread may take a bit between the read and the claim, so retry the chunk until it is full
+        uint64_t v;
+        while ((v = bitmap_chunk(bm, i)) != ~0ULL) {
+            size_t bit = i * 64 + __builtin_ctzll(~v);
+            if (bitmap_claim(bm, bit)) {
+                cur->chunk = i;
+                return bit;
+            }
+        }
+    }
+    return -1;
+}
+
+long bitmap_alloc(struct bitmap *bm, struct bitmap_cursor *cur) {
+    return bitmap_alloc_range(bm, cur, 0, bm->num_bits);
+}
+
+long bitmap_alloc_at(struct bitmap *bm, size_t bit) {
+    if (bit >= bm->num_bits || !bitmap_claim(bm, bit)) {
+        return -1;
+    }
+    return bit;
+}
+
+void bitmap_free(struct bitmap *bm, size_t bit) {
+    unsigned int mask = 1U << (bit % 32);
+    if (__atomic_fetch_and(&bm->words[bit / 32], ~mask, __ATOMIC_RELEASE) & mask) {
+        __atomic_add_fetch(&bm->free, 1, __ATOMIC_RELAXED);
+    }
+}
+
+int bitmap_test(const struct bitmap *bm, size_t bit) {
+    return bitmap_load(bm, bit / 32) >> (bit % 32) & 1;
+}
+
+size_t bitmap_count_free(const struct bitmap *bm) {
+    size_t used = 0;
+    for (size_t i = 0; i < (bm->num_bits + 63) / 64; ++i) {
+        used += __builtin_popcountll(bitmap_chunk(bm, i)); // Bits past the end read as set, so they never count as free
+    }
+    return (bm->num_bits + 63) / 64 * 64 - used;
+}
+
+size_t bitmap_free_bits(const struct bitmap *bm) {
+    return __atomic_load_n(&bm->free, __ATOMIC_RELAXED);
+}
+
+unsigned int *bitmap_word(const struct bitmap *bm, size_t bit) {
+    return &bm->words[bit / 32];
+}
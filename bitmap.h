@@ -0,0 +1,59 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  Allocator over the on-disk bitmaps. Both bitmaps are arrays of 32-bit
+  ints with bit i of the filesystem at bit i % 32 of word i / 32, as laid
+  down by `initialize_bitmap()` in mkfs. The allocator scans them 64 bits
+  at a time and picks the first clear bit with a count-trailing-zeros.
+
+  Bits are claimed with an atomic fetch-or on their word and released
+  with an atomic fetch-and, so any number of threads can allocate at once
+  without a lock; a thread that loses a race for a bit simply looks at
+  the word again. Each thread searches from its own cursor, and cursors
+  start in different regions of the bitmap so concurrent allocators work
+  on different cache lines.
+*/
+
+#define BITMAP_REGIONS (16) // Distinct starting points handed out to new cursors
+
+struct bitmap {
+    unsigned int *words;  /* The bitmap inside the disk mapping */
+    size_t num_bits;      /* Number of usable bits */
+    unsigned int cursors; /* Cursors started so far, to pick the next one's region */
+    size_t free;          /* Clear bits; the caller seeds it, and every claim and release keeps it exact */
+};
+
+// One thread's place in a bitmap; zero-initialize it and the first allocation places it
+struct bitmap_cursor {
+    size_t chunk; /* 64-bit chunk where the next search starts */
+    int started;
+};
+
+void bitmap_init(struct bitmap *bm, void *words, size_t num_bits);
+
+// Claim the first clear bit at or after the cursor and return its index, or -1 if none are left
+long bitmap_alloc(struct bitmap *bm, struct bitmap_cursor *cur);
+
+/*
+  Like bitmap_alloc(), but only among bits [start, end). `start` must be a
+  multiple of 64 and `end` one too, or the end of the bitmap, so that no
+  64-bit chunk is shared with another range. Give each range its own cursor.
+*/
+long bitmap_alloc_range(struct bitmap *bm, struct bitmap_cursor *cur, size_t start, size_t end);
+
+// Claim one particular bit, returning it, or -1 if it is already taken
+long bitmap_alloc_at(struct bitmap *bm, size_t bit);
+
+void bitmap_free(struct bitmap *bm, size_t bit);
+
+int bitmap_test(const struct bitmap *bm, size_t bit);
+
+// Count the clear bits by scanning the whole bitmap, to seed `free` when no stored count can be trusted
+size_t bitmap_count_free(const struct bitmap *bm);
+
+// Current number of clear bits, without a scan
+size_t bitmap_free_bits(const struct bitmap *bm);
+
+// The 32-bit word holding `bit`, for callers that need to copy it elsewhere
+unsigned int *bitmap_word(const struct bitmap *bm, size_t bit);
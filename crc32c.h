@@ -0,0 +1,17 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  CRC32C (Castagnoli), as used for data block checksums. crc32c_init()
+  picks the CPU's CRC instructions when it has them (SSE4.2 on x86-64,
+  the CRC extension on ARMv8) and a table-driven version otherwise; call
+  it once before the first checksum.
+*/
+
+void crc32c_init(void);
+
+// Extend `crc` over `len` bytes; start a new checksum with crc = 0
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+// Name of the implementation crc32c_init() chose, for diagnostics
+const char *crc32c_impl(void);
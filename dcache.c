@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "wfs.h"
+#include "dcache.h"
+
+#define DCACHE_NAME (DIRENT_NAME_MAX + 1) // Room for the longest name of either dentry format
+
+struct dentry_cache_entry {
+    int parent;
+    int num;
+    char name[DCACHE_NAME];
+    struct dentry_cache_entry *hash_next;
+    struct dentry_cache_entry *lru_prev, *lru_next;
+};
+
+static struct dentry_cache_entry *pool;
+static struct dentry_cache_entry **buckets;
+static size_t num_buckets;
+static struct dentry_cache_entry *free_list;
+static struct dentry_cache_entry lru; // Sentinel: lru.lru_next is the most recently used
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // Even a hit reorders the LRU list
+
+void dcache_init(size_t capacity) {
+    num_buckets = 1;
+    while (num_buckets < capacity * 2) {
+        num_buckets <<= 1;
+    }
+    pool = calloc(capacity, sizeof(*pool));
+    buckets = calloc(num_buckets, sizeof(*buckets));
+    if (!pool || !buckets) {
+        perror("Failed to allocate dentry cache");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < capacity; ++i) {
+        pool[i].hash_next = free_list;
+        free_list = &pool[i];
+    }
+    lru.lru_prev = lru.lru_next = &lru;
+}
+
+static size_t dcache_bucket(int parent, const char *name) {
+    unsigned int h = 2166136261U ^ (unsigned int)parent; // FNV-1a over the parent and the name
+    for (int i = 0; i < DCACHE_NAME && name[i]; ++i) {
+        h = (h ^ (unsigned char)name[i]) * 16777619U;
+    }
+    return h & (num_buckets - 1);
+}
+
+static struct dentry_cache_entry **dcache_find(int parent, const char *name) {
+    struct dentry_cache_entry **link = &buckets[dcache_bucket(parent, name)];
+    while (*link && ((*link)->parent != parent || strncmp((*link)->name, name, DCACHE_NAME) != 0)) {
+        link = &(*link)->hash_next;
+    }
+    return link;
+}
+
+static void lru_unlink(struct dentry_cache_entry *e) {
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push(struct dentry_cache_entry *e) {
+    e->lru_next = lru.lru_next;
+    e->lru_prev = &lru;
+    lru.lru_next->lru_prev = e;
+    lru.lru_next = e;
+}
+
+int dcache_lookup(int parent, const char *name, int *num) {
+    pthread_mutex_lock(&lock);
+    struct dentry_cache_entry *e = *dcache_find(parent, name);
+    if (e) {
+        lru_unlink(e);
+        lru_push(e);
+        *num = e->num;
+    }
+    pthread_mutex_unlock(&lock);
+    return e != NULL;
+}
+
+void dcache_insert(int parent, const char *name, int num) {
+    pthread_mutex_lock(&lock);
+    struct dentry_cache_entry **link = dcache_find(parent, name);
+    struct dentry_cache_entry *e = *link;
+
+    if (e) {
+        lru_unlink(e);
+    } else {
+        if (!free_list) {
+            // Evict the least recently used entry
+            struct dentry_cache_entry *old = lru.lru_prev;
+            lru_unlink(old);
+            *dcache_find(old->parent, old->name) = old->hash_next;
+            old->hash_next = free_list;
+            free_list = old;
+            link = dcache_find(parent, name);
+        }
+        e = free_list;
+        free_list = e->hash_next;
+
+        e->parent = parent;
+        size_t n = strnlen(name, DCACHE_NAME - 1);
+        memcpy(e->name, name, n);
+        e->name[n] = '\0';
+        e->hash_next = NULL;
+        *link = e;
+    }
+    e->num = num;
+    lru_push(e);
+    pthread_mutex_unlock(&lock);
+}
+
+void dcache_forget(int parent, const char *name) {
+    pthread_mutex_lock(&lock);
+    struct dentry_cache_entry **link = dcache_find(parent, name);
+    struct dentry_cache_entry *e = *link;
+    if (e) {
+        *link = e->hash_next;
+        lru_unlink(e);
+        e->hash_next = free_list;
+        free_list = e;
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,21 @@
+#include <stddef.h>
+
+/*
+  Cache of directory lookups: (parent inode number, name) -> inode number.
+  Names that were looked up and not found are kept as negative entries
+  holding -ENOENT, so repeated stats of missing files skip the directory
+  scan as well. The cache has a fixed number of entries and evicts the
+  least recently used one when it is full. All calls are safe to make
+  from several threads at once.
+*/
+
+void dcache_init(size_t capacity);
+
+// Return 1 and store the cached result in *num on a hit, 0 on a miss
+int dcache_lookup(int parent, const char *name, int *num);
+
+// Record what `name` in `parent` resolves to, replacing any cached answer
+void dcache_insert(int parent, const char *name, int num);
+
+// Drop whatever is cached for `name` in `parent`
+void dcache_forget(int parent, const char *name);
@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "wfs.h"
+#include "journal.h"
+
+#define JOURNAL_MAX_DISKS (32)
+#define UNIT_MASK ((1ULL << 48) - 1)
+
+static int num_disks;
+static int fds[JOURNAL_MAX_DISKS];
+static char *views[JOURNAL_MAX_DISKS];
+static size_t sizes[JOURNAL_MAX_DISKS];
+static off_t heads[JOURNAL_MAX_DISKS];         /* Where each disk's next transaction goes */
+static unsigned long seqs[JOURNAL_MAX_DISKS];  /* Sequence number of each disk's next transaction */
+static off_t j_start;
+static size_t j_size;
+static size_t max_units; /* Most units one transaction can carry */
+
+/*
+  The running transaction: the set of dirty units, as an open-addressing
+  hash table of keys holding the unit number in the low 48 bits and
+  the disk plus 2 above them, so that no key is 0.
+*/
+static uint64_t *set;
+static size_t set_cap, set_used;
+static pthread_mutex_t set_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t desc_units(size_t count) {
+    return (sizeof(struct wfs_journal_header) + count * sizeof(off_t) + JOURNAL_UNIT - 1) / JOURNAL_UNIT;
+}
+
+static unsigned int fnv(unsigned int h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ p[i]) * 16777619U;
+    }
+    return h;
+}
+
+static unsigned int checksum(unsigned long seq, unsigned int count, const off_t *offs, const char *images) {
+    unsigned int h = 2166136261U;
+    h = fnv(h, &seq, sizeof(seq));
+    h = fnv(h, &count, sizeof(count));
+    h = fnv(h, offs, count * sizeof(off_t));
+    return fnv(h, images, (size_t)count * JOURNAL_UNIT);
+}
+
+void journal_init(int n, const int *disk_fds, char *const *disk_views, const size_t *disk_sizes, off_t start, size_t size) {
+    num_disks = n;
+    for (int d = 0; d < n; ++d) {
+        fds[d] = disk_fds[d];
+        views[d] = disk_views[d];
+        sizes[d] = disk_sizes[d];
+        heads[d] = 0;
+        seqs[d] = 1;
+    }
+    j_start = start;
+    j_size = size;
+
+    size_t total = size / JOURNAL_UNIT;
+    max_units = total;
+    while (max_units > 0 && desc_units(max_units) + max_units > total) {
+        --max_units;
+    }
+
+    set_cap = 1024;
+    set = calloc(set_cap, sizeof(*set));
+    if (!set) {
+        perror("Failed to allocate journal");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int journal_recover(char *map, size_t map_size, off_t start, size_t size, char *const *mirrors, int num_mirrors, off_t mirrored_end) {
+    off_t pos = 0;
+    unsigned long seq = 0;
+    int replayed = 0;
+    int indexes[JOURNAL_MAX_DISKS];
+    for (int m = 0; m < num_mirrors; ++m) {
+        indexes[m] = ((struct wfs_sb *)mirrors[m])->disk_index;
+    }
+
+    while (pos + sizeof(struct wfs_journal_header) <= size) {
+        const struct wfs_journal_header *h = (const struct wfs_journal_header *)(map + start + pos);
+        if (h->magic != WFS_JOURNAL_MAGIC || h->count == 0 || h->count > size / JOURNAL_UNIT ||
+            (replayed && h->seq != seq + 1)) {
+            break;
+        }
+        size_t desc = desc_units(h->count) * JOURNAL_UNIT;
+        size_t len = desc + (size_t)h->count * JOURNAL_UNIT;
+        if (pos + len > size) {
+            break;
+        }
+        const off_t *offs = (const off_t *)(h + 1);
+        const char *images = (const char *)h + desc;
+        if (checksum(h->seq, h->count, offs, images) != h->checksum) {
+            break; // Torn by a crash, so it never committed
+        }
+
+        unsigned int i;
+        for (i = 0; i < h->count; ++i) {
+            off_t off = offs[i];
+            if (off < 0 || off % JOURNAL_UNIT || off + JOURNAL_UNIT > (off_t)map_size ||
+                (off + JOURNAL_UNIT > start && off < start + (off_t)size)) {
+                break;
+            }
+        }
+        if (i < h->count) {
+            break;
+        }
+        for (i = 0; i < h->count; ++i) {
+            const char *image = images + (size_t)i * JOURNAL_UNIT;
+            memcpy(map + offs[i], image, JOURNAL_UNIT);
+            for (int m = 0; offs[i] < mirrored_end && m < num_mirrors; ++m) {
+                memcpy(mirrors[m] + offs[i], image, JOURNAL_UNIT);
+            }
+        }
+        seq = h->seq;
+        pos += len;
+        replayed++;
+    }
+
+    // Replayed units must be home for good before the journal that holds them is cleared
+    if (replayed) {
+        for (int m = 0; m < num_mirrors; ++m) {
+            ((struct wfs_sb *)mirrors[m])->disk_index = indexes[m]; // Each superblock keeps its own position
+            msync(mirrors[m], mirrored_end, MS_SYNC);
+        }
+        msync(map, map_size, MS_SYNC);
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    off_t first = start / page * page;
+    memset(map + start, 0, size);
+    msync(map + first, start + size - first, MS_SYNC);
+    return replayed;
+}
+
+static size_t set_slot(const uint64_t *table, size_t cap, uint64_t key) {
+    size_t i = (key * 0x9e3779b97f4a7c15ULL) >> 20 & (cap - 1);
+    while (table[i] && table[i] != key) {
+        i = (i + 1) & (cap - 1);
+    }
+    return i;
+}
+
+static void set_insert(uint64_t key) {
+    if ((set_used + 1) * 2 > set_cap) {
+        size_t cap = set_cap * 2;
+        uint64_t *table = calloc(cap, sizeof(*table));
+        if (!table) {
+            perror("Failed to grow journal transaction");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < set_cap; ++i) {
+            if (set[i]) {
+                table[set_slot(table, cap, set[i])] = set[i];
+            }
+        }
+        free(set);
+        set = table;
+        set_cap = cap;
+    }
+
+    size_t i = set_slot(set, set_cap, key);
+    if (!set[i]) {
+        set[i] = key;
+        set_used++;
+    }
+}
+
+void journal_dirty(int disk, off_t off, size_t len) {
+    if (!set || len == 0) {
+        return;
+    }
+    pthread_mutex_lock(&set_lock);
+    for (off_t unit = off / JOURNAL_UNIT; unit <= (off_t)(off + len - 1) / JOURNAL_UNIT; ++unit) {
+        set_insert((uint64_t)(disk + 2) << 48 | (uint64_t)unit);
+    }
+    pthread_mutex_unlock(&set_lock);
+}
+
+int journal_full(void) {
+    pthread_mutex_lock(&set_lock);
+    int full = set && set_used * 2 > max_units;
+    pthread_mutex_unlock(&set_lock);
+    return full;
+}
+
+static int key_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a & UNIT_MASK, y = *(const uint64_t *)b & UNIT_MASK;
+    return (x > y) - (x < y);
+}
+
+// Append one transaction of `count` units to disk `d`'s journal
+static int log_transaction(int d, const off_t *offs, size_t count) {
+    size_t desc = desc_units(count) * JOURNAL_UNIT;
+    size_t len = desc + count * JOURNAL_UNIT;
+    char *buf = calloc(1, len);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    struct wfs_journal_header *h = (struct wfs_journal_header *)buf;
+    memcpy(h + 1, offs, count * sizeof(off_t));
+    for (size_t i = 0; i < count; ++i) {
+        memcpy(buf + desc + i * JOURNAL_UNIT, views[d] + offs[i], JOURNAL_UNIT);
+    }
+    h->magic = WFS_JOURNAL_MAGIC;
+    h->count = count;
+    h->seq = seqs[d];
+    h->checksum = checksum(h->seq, h->count, offs, buf + desc);
+
+    int err = 0;
+    if (pwrite(fds[d], buf, len, j_start + heads[d]) != (ssize_t)len) {
+        err = -EIO;
+    } else {
+        heads[d] += len;
+        seqs[d]++;
+    }
+    free(buf);
+    return err;
+}
+
+// Once the journal holding them is durable, copy logged units home, a run of adjacent units per write
+static int write_home(int d, const off_t *offs, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    if (fdatasync(fds[d]) < 0) {
+        return -errno;
+    }
+    for (size_t i = 0; i < count; ) {
+        size_t run = 1;
+        while (i + run < count && offs[i + run] == offs[i] + (off_t)(run * JOURNAL_UNIT)) {
+            ++run;
+        }
+        size_t len = run * JOURNAL_UNIT;
+        if (pwrite(fds[d], views[d] + offs[i], len, offs[i]) != (ssize_t)len) {
+            return -EIO;
+        }
+        i += run;
+    }
+    return 0;
+}
+
+/*
+  Once everything logged is home and durable, invalidate the journal and
+  start it over. A block freed by a logged transaction can be reused for
+  file data, which isn't journaled, so replaying that transaction after a
+  crash would write stale metadata over live data.
+*/
+static int retire(int d) {
+    char zeros[JOURNAL_UNIT] = {0};
+    if (fdatasync(fds[d]) < 0) {
+        return -errno;
+    }
+    if (pwrite(fds[d], zeros, sizeof(zeros), j_start) != sizeof(zeros)) {
+        return -EIO;
+    }
+    if (fdatasync(fds[d]) < 0) {
+        return -errno;
+    }
+    heads[d] = 0;
+    return 0;
+}
+
+static int commit_disk(int d, const uint64_t *keys, size_t n) {
+    off_t *offs = malloc(n * sizeof(*offs));
+    if (!offs) {
+        return -ENOMEM;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        int disk = (int)(keys[i] >> 48) - 2;
+        if (disk < 0 || disk == d) {
+            offs[count++] = (off_t)(keys[i] & UNIT_MASK) * JOURNAL_UNIT;
+        }
+    }
+
+    /*
+      A transaction too big for the journal goes in as several; each is
+      still all or nothing. Units in [home, logged) are in the journal but
+      not yet home.
+    */
+    int err = 0;
+    size_t home = 0, logged = 0;
+    while (logged < count && err == 0) {
+        size_t c = count - logged < max_units ? count - logged : max_units;
+        size_t len = (desc_units(c) + c) * JOURNAL_UNIT;
+        if (heads[d] + len > j_size) {
+            // Starting over overwrites old transactions, so what they logged must be home and durable first
+            err = write_home(d, offs + home, logged - home);
+            home = logged;
+            if (err == 0 && fdatasync(fds[d]) < 0) {
+                err = -errno;
+            }
+            heads[d] = 0;
+            if (err < 0) {
+                break;
+            }
+        }
+        err = log_transaction(d, offs + logged, c);
+        logged += c;
+    }
+    if (err == 0) {
+        err = write_home(d, offs + home, logged - home);
+    }
+    free(offs);
+    return err;
+}
+
+void journal_close(void) {
+    char zeros[JOURNAL_UNIT] = {0};
+    for (int d = 0; set && d < num_disks; ++d) {
+        if (fdatasync(fds[d]) == 0 && pwrite(fds[d], zeros, sizeof(zeros), j_start) == sizeof(zeros)) {
+            fdatasync(fds[d]);
+        }
+    }
+}
+
+int journal_commit(void) {
+    if (!set) {
+        return 0;
+    }
+
+    // Take the running transaction and start an empty one
+    pthread_mutex_lock(&set_lock);
+    uint64_t *keys = malloc((set_used ? set_used : 1) * sizeof(*keys));
+    if (!keys) {
+        pthread_mutex_unlock(&set_lock);
+        return -ENOMEM;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < set_cap; ++i) {
+        if (set[i]) {
+            keys[n++] = set[i];
+            set[i] = 0;
+        }
+    }
+    set_used = 0;
+    pthread_mutex_unlock(&set_lock);
+
+    if (n == 0) {
+        free(keys);
+        return 0;
+    }
+    qsort(keys, n, sizeof(*keys), key_cmp);
+
+    // Recovery copies the first disk's journal to the rest, so no journal is cleared before all are home
+    int err = 0;
+    for (int d = 0; d < num_disks && err == 0; ++d) {
+        err = commit_disk(d, keys, n);
+    }
+    for (int d = 0; d < num_disks && err == 0; ++d) {
+        if (heads[d] > 0) {
+            err = retire(d);
+        }
+    }
+
+    if (err < 0) {
+        // Keep the changes pending so the next commit tries again
+        pthread_mutex_lock(&set_lock);
+        for (size_t i = 0; i < n; ++i) {
+            set_insert(keys[i]);
+        }
+        pthread_mutex_unlock(&set_lock);
+    } else {
+        // Everything in the private views is home now, so let them fall back to the files
+        for (int d = 0; d < num_disks; ++d) {
+            madvise(views[d], sizes[d], MADV_DONTNEED);
+        }
+    }
+    free(keys);
+    return err;
+}
@@ -0,0 +1,47 @@
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+  Write-ahead journal for metadata, in the layout described in wfs.h.
+  Callers report every metadata range they change with journal_dirty();
+  the ranges collect into one running transaction shared by every
+  operation in flight. journal_commit() writes the transaction into each
+  disk's journal as one sequential write, waits for it to reach the disk,
+  and only then copies the logged units to their home locations, so a
+  crash leaves either all of a transaction's changes or none of them.
+  Once they are home for good on every disk the journals are cleared
+  again, so recovery only ever replays transactions that never finished
+  their way home.
+
+  The caller hands over two views of each disk: the file descriptor,
+  which is where committed units are written home, and a private mapping
+  that holds the uncommitted state. After a commit the private mappings
+  are dropped back to the file's contents.
+*/
+
+void journal_init(int num_disks, const int *fds, char *const *views, const size_t *sizes, off_t start, size_t size);
+
+/*
+  Replay the committed transactions found in one disk's journal into its
+  shared mapping, make them durable and clear the journal. Units below
+  `mirrored_end` are copied into each of the `num_mirrors` mappings in
+  `mirrors` as well. Returns the number of transactions replayed. Runs at
+  mount, before journal_init().
+*/
+int journal_recover(char *map, size_t map_size, off_t start, size_t size, char *const *mirrors, int num_mirrors, off_t mirrored_end);
+
+// Record that `len` bytes at `off` changed on disk `disk`, or on every disk if `disk` is negative
+void journal_dirty(int disk, off_t off, size_t len);
+
+// Whether the running transaction is large enough that it should be committed now
+int journal_full(void);
+
+/*
+  Commit the running transaction and write it home. The caller must make
+  sure nothing calls journal_dirty() or modifies metadata meanwhile.
+  Returns 0, or a negative errno if a journal write failed.
+*/
+int journal_commit(void);
+
+// After a final commit: make everything durable and mark the journals empty, so the next mount replays nothing
+void journal_close(void);
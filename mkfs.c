@@ -1,34 +1,66 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include "wfs.h"
 
+#define ZERO_CHUNK (1 << 20) // Size of the zero buffer used when fallocate can't help
+#define ZERO_IOVS  (16)      // Chunks submitted per pwritev call
+
 void print_usage(const char *progname) {
-    fprintf(stderr, "Usage: %s -r <raid_mode> -d <disk1> -d <disk2> ... -i <num_inodes> -b <num_blocks>\n", progname);
+    fprintf(stderr, "Usage: %s -r <raid_mode> -d <disk1> -d <disk2> ... -i <num_inodes> -b <num_blocks> [-B <block_size>] [-c <chunk_kb>] [-p] [-e] [-H] [-t] [-j <journal_kb>] [-l] [-g <groups>] [-k] [-n]\n", progname);
+    fprintf(stderr, "  -B  block size in bytes, a power of two from %d to %d (default %d)\n", BLOCK_SIZE, MAX_BLOCK_SIZE, BLOCK_SIZE);
+    fprintf(stderr, "  -c  RAID 0 stripe unit in KB (default: one block)\n");
+    fprintf(stderr, "  -p  pack %zu inodes into each %d-byte inode-table block\n", BLOCK_SIZE / PACKED_INODE_SIZE, BLOCK_SIZE);
+    fprintf(stderr, "  -e  map file data with extent trees instead of direct/indirect pointers\n");
+    fprintf(stderr, "  -H  index large directories by name hash\n");
+    fprintf(stderr, "  -t  store tiny files inside their inode instead of in data blocks\n");
+    fprintf(stderr, "  -j  reserve a metadata journal of this many KB\n");
+    fprintf(stderr, "  -l  skip zeroing the inode table; inodes are cleared when first allocated\n");
+    fprintf(stderr, "  -g  split inodes and data blocks into this many allocation groups (at most %d)\n", WFS_MAX_GROUPS);
+    fprintf(stderr, "  -k  keep a CRC32C checksum of every data block, checked on read\n");
+    fprintf(stderr, "  -n  store directory entries as variable-length records with the file type, for names of up to %d bytes (160 with %d-byte blocks)\n", DIRENT_NAME_MAX, BLOCK_SIZE);
     exit(EXIT_FAILURE);
 }
 
-void initialize_superblock(struct wfs_sb *sb, size_t num_inodes, size_t num_blocks, int raid_mode, size_t disk_size) {
+void initialize_superblock(struct wfs_sb *sb, size_t num_inodes, size_t num_blocks, int raid_mode, int num_disks, size_t block_size, size_t chunk_size, size_t journal_size, size_t disk_size, unsigned int features) {
     // Round up the number of inodes to the nearest multiple of 32 for alignment
     num_inodes = (num_inodes + 31) / 32 * 32;
 
     sb->num_inodes = num_inodes;
     sb->num_data_blocks = num_blocks;
+    sb->features = features;
+    sb->inode_size = (features & WFS_FEATURE_PACKED_INODES) ? PACKED_INODE_SIZE : BLOCK_SIZE;
+    sb->raid_mode = raid_mode;
+    sb->num_disks = num_disks;
+    sb->block_size = block_size;
+    sb->chunk_size = chunk_size;
 
     size_t inode_bitmap_size = ((num_inodes + 31) / 32) * sizeof(int); // Bitmap size in bytes
     size_t data_bitmap_size = ((num_blocks + 31) / 32) * sizeof(int); // Bitmap size in bytes
 
     sb->i_bitmap_ptr = sizeof(struct wfs_sb);
     sb->d_bitmap_ptr = sb->i_bitmap_ptr + inode_bitmap_size;
-    sb->i_blocks_ptr = ((sb->d_bitmap_ptr + data_bitmap_size + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
-    sb->d_blocks_ptr = ((sb->i_blocks_ptr + num_inodes * BLOCK_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
+    sb->i_blocks_ptr = ((sb->d_bitmap_ptr + data_bitmap_size + block_size - 1) / block_size) * block_size;
+    sb->j_blocks_ptr = ((sb->i_blocks_ptr + num_inodes * sb->inode_size + block_size - 1) / block_size) * block_size;
+    sb->journal_size = journal_size;
+    sb->c_blocks_ptr = ((sb->j_blocks_ptr + journal_size + block_size - 1) / block_size) * block_size;
+    size_t csum_size = (features & WFS_FEATURE_CHECKSUMS) ? num_blocks * sizeof(uint32_t) : 0;
+    sb->d_blocks_ptr = ((sb->c_blocks_ptr + csum_size + block_size - 1) / block_size) * block_size;
+    sb->free_inodes = num_inodes - 1; // All but the root
+    sb->free_blocks = num_blocks;
+    sb->counts_valid = 1;
 
     // Validate that the calculated layout fits within the disk size
-    if (sb->d_blocks_ptr + (num_blocks * BLOCK_SIZE) > disk_size) {
+    if (sb->d_blocks_ptr + DISK_DATA_SIZE(sb) > disk_size) {
         fprintf(stderr, "Error: Disk size too small for the specified filesystem layout.\n");
         exit(-1);
     }
@@ -63,16 +95,61 @@ void initialize_bitmap(int fd, size_t offset, size_t num_bits, int allocate_firs
     free(bitmap);
 }
 
-void initialize_inodes(int fd, size_t inode_offset, size_t num_inodes) {
-    struct wfs_inode empty_inode = {0};
+double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Zero a byte range of the disk, in one fallocate call where the backing store supports it; `what` names it in errors
+void zero_range(int fd, off_t offset, size_t len, const char *what) {
+    if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+        return;
+    }
+
+    // Otherwise write large chunks of one shared zero buffer, several per syscall
+    char *zeros = calloc(1, ZERO_CHUNK);
+    if (!zeros) {
+        perror("Failed to allocate memory for zero buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    struct iovec iov[ZERO_IOVS];
+    while (len > 0) {
+        int n = 0;
+        size_t batch = 0;
+        while (n < ZERO_IOVS && batch < len) {
+            size_t chunk = len - batch < ZERO_CHUNK ? len - batch : ZERO_CHUNK;
+            iov[n].iov_base = zeros;
+            iov[n].iov_len = chunk;
+            batch += chunk;
+            ++n;
+        }
 
-    // Write all inodes to the inode table
-    for (size_t i = 0; i < num_inodes; ++i) {
-        if (pwrite(fd, &empty_inode, sizeof(empty_inode), inode_offset + i * BLOCK_SIZE) != sizeof(empty_inode)) {
-            perror("Failed to initialize inodes");
+        ssize_t written = pwritev(fd, iov, n, offset);
+        if (written <= 0) {
+            fprintf(stderr, "Failed to initialize %s: %s\n", what, written < 0 ? strerror(errno) : "No space left on device");
+            free(zeros);
             exit(EXIT_FAILURE);
         }
+        offset += written;
+        len -= written;
     }
+
+    free(zeros);
+}
+
+void initialize_inodes(int fd, size_t inode_offset, size_t num_inodes, size_t inode_size) {
+    struct timespec start;
+    size_t len = num_inodes * inode_size;
+
+    // Zero the whole inode table at once rather than one inode at a time
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    zero_range(fd, inode_offset, len, "the inode table");
+
+    double secs = elapsed_since(&start);
+    printf("Inode table: %.1f MB zeroed in %.3f s (%.1f MB/s)\n",
+           len / 1e6, secs, secs > 0 ? len / 1e6 / secs : 0.0);
 }
 
 int initialize_root_inode(int fd[], int num_disks, struct wfs_sb *superblock) {
@@ -88,9 +165,11 @@ int initialize_root_inode(int fd[], int num_disks, struct wfs_sb *superblock) {
         .ctim = time(NULL),
     };
 
-    // Write the root inode to all disks
+    // Write the root inode's whole slot to all disks, since a lazy inode table was never zeroed
+    char slot[BLOCK_SIZE] = {0};
+    memcpy(slot, &root_inode, sizeof(root_inode));
     for (int i = 0; i < num_disks; ++i) {
-        if (pwrite(fd[i], &root_inode, sizeof(root_inode), superblock->i_blocks_ptr) != sizeof(root_inode)) {
+        if (pwrite(fd[i], slot, superblock->inode_size, superblock->i_blocks_ptr) != (ssize_t)superblock->inode_size) {
             perror("Failed to write root inode");
             return -1;
         }
@@ -117,15 +196,96 @@ int initialize_root_inode(int fd[], int num_disks, struct wfs_sb *superblock) {
     return 0;
 }
 
+// Everything one worker thread needs to format a single disk
+struct format_job {
+    const char *path;
+    int fd;
+    int disk_index;
+    int num_disks;
+    const unsigned char *uuid;
+    size_t num_inodes;
+    size_t num_blocks;
+    int raid_mode;
+    size_t block_size;
+    size_t chunk_size;
+    size_t journal_size;
+    size_t num_groups;
+    unsigned int features;
+    struct wfs_sb superblock;
+};
+
+void *format_disk(void *arg) {
+    struct format_job *job = arg;
+
+    job->fd = open(job->path, O_RDWR | O_CREAT, 0644);
+    if (job->fd < 0) {
+        perror("Failed to open disk image");
+        exit(EXIT_FAILURE);
+    }
+
+    off_t disk_size = lseek(job->fd, 0, SEEK_END);
+    if (disk_size < 0) {
+        perror("Failed to get disk size");
+        close(job->fd);
+        exit(EXIT_FAILURE);
+    }
+
+    initialize_superblock(&job->superblock, job->num_inodes, job->num_blocks, job->raid_mode, job->num_disks, job->block_size, job->chunk_size, job->journal_size, disk_size, job->features);
+    job->superblock.num_groups = job->num_groups;
+    job->superblock.disk_index = job->disk_index;
+    memcpy(job->superblock.uuid, job->uuid, sizeof(job->superblock.uuid));
+    write_superblock(job->fd, &job->superblock);
+
+    // Initialize bitmaps
+    initialize_bitmap(job->fd, job->superblock.i_bitmap_ptr, job->num_inodes, 0); // Do not allocate inode in initialize_bitmap
+    initialize_bitmap(job->fd, job->superblock.d_bitmap_ptr, job->num_blocks, 0); // No data blocks allocated initially
+
+    // Initialize the inode table for this disk, unless the daemon is left to clear each slot as it allocates it
+    if (!(job->features & WFS_FEATURE_LAZY_ITABLE)) {
+        initialize_inodes(job->fd, job->superblock.i_blocks_ptr, job->superblock.num_inodes, job->superblock.inode_size);
+    }
+
+    /*
+      An empty journal is all zeros. Replay stops at the first invalid
+      header, and mount clears the whole journal, so a lazy mkfs only
+      needs to clear the first header.
+    */
+    if (job->journal_size) {
+        size_t len = (job->features & WFS_FEATURE_LAZY_ITABLE) ? JOURNAL_UNIT : job->journal_size;
+        zero_range(job->fd, job->superblock.j_blocks_ptr, len, "the journal");
+    }
+
+    // Entries only count once their block is allocated, but a zeroed table lets the mirrors compare equal
+    if (job->features & WFS_FEATURE_CHECKSUMS) {
+        zero_range(job->fd, job->superblock.c_blocks_ptr, job->superblock.num_data_blocks * sizeof(uint32_t), "the checksum table");
+    }
+    return NULL;
+}
+
+// Fill in a random filesystem UUID
+void generate_uuid(unsigned char *uuid, size_t len) {
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, uuid, len) != (ssize_t)len) {
+        perror("Failed to generate filesystem UUID");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
 int main(int argc, char *argv[]) {
     int raid_mode = -1;
     size_t num_inodes = 0, num_blocks = 0;
+    size_t block_size = BLOCK_SIZE;
+    size_t chunk_size = 0; // One block unless -c says otherwise
+    size_t journal_size = 0;
+    size_t num_groups = 1;
+    unsigned int features = 0;
     char *disk_files[32];
     int num_disks = 0;
     int fds[32];
 
     int opt;
-    while ((opt = getopt(argc, argv, "r:d:i:b:")) != -1) {
+    while ((opt = getopt(argc, argv, "r:d:i:b:B:c:j:g:peHtlkn")) != -1) {
         switch (opt) {
             case 'r':
                 raid_mode = atoi(optarg);
@@ -147,6 +307,57 @@ int main(int argc, char *argv[]) {
             case 'b':
                 num_blocks = strtoul(optarg, NULL, 10);
                 break;
+            case 'B':
+                block_size = strtoul(optarg, NULL, 10);
+                if (block_size < BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+                    fprintf(stderr, "Invalid block size: %s\n", optarg);
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'c':
+                chunk_size = strtoul(optarg, NULL, 10) * 1024;
+                if (chunk_size == 0) {
+                    fprintf(stderr, "Invalid chunk size: %s\n", optarg);
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'j':
+                journal_size = strtoul(optarg, NULL, 10) * 1024;
+                if (journal_size < 4 * JOURNAL_UNIT) {
+                    fprintf(stderr, "Invalid journal size: %s\n", optarg);
+                    print_usage(argv[0]);
+                }
+                features |= WFS_FEATURE_JOURNAL;
+                break;
+            case 'g':
+                num_groups = strtoul(optarg, NULL, 10);
+                if (num_groups == 0 || num_groups > WFS_MAX_GROUPS) {
+                    fprintf(stderr, "Invalid number of allocation groups: %s\n", optarg);
+                    print_usage(argv[0]);
+                }
+                features |= WFS_FEATURE_GROUPS;
+                break;
+            case 'p':
+                features |= WFS_FEATURE_PACKED_INODES;
+                break;
+            case 'e':
+                features |= WFS_FEATURE_EXTENTS;
+                break;
+            case 'H':
+                features |= WFS_FEATURE_DIR_INDEX;
+                break;
+            case 't':
+                features |= WFS_FEATURE_INLINE_DATA;
+                break;
+            case 'l':
+                features |= WFS_FEATURE_LAZY_ITABLE;
+                break;
+            case 'k':
+                features |= WFS_FEATURE_CHECKSUMS;
+                break;
+            case 'n':
+                features |= WFS_FEATURE_VAR_DENTRIES;
+                break;
             default:
                 print_usage(argv[0]);
         }
@@ -157,33 +368,56 @@ int main(int argc, char *argv[]) {
     }
 
     num_blocks = (num_blocks + 31) / 32 * 32; // Round to nearest multiple of 32
+    if (features & WFS_FEATURE_GROUPS) {
+        // Every group gets the same whole number of bitmap chunks of each kind
+        num_inodes = (num_inodes + num_groups * GROUP_ALIGN - 1) / (num_groups * GROUP_ALIGN) * num_groups * GROUP_ALIGN;
+        num_blocks = (num_blocks + num_groups * GROUP_ALIGN - 1) / (num_groups * GROUP_ALIGN) * num_groups * GROUP_ALIGN;
+    }
 
-    struct wfs_sb superblock; // Declare superblock locally
+    if (chunk_size == 0) {
+        chunk_size = block_size;
+    } else if (chunk_size % block_size != 0) {
+        fprintf(stderr, "Chunk size must be a multiple of the block size.\n");
+        print_usage(argv[0]);
+    }
 
-    for (int i = 0; i < num_disks; ++i) {
-        fds[i] = open(disk_files[i], O_RDWR | O_CREAT, 0644);
-        if (fds[i] < 0) {
-            perror("Failed to open disk image");
-            exit(EXIT_FAILURE);
-        }
+    // The disks are independent devices, so format each one on its own thread
+    struct format_job jobs[32];
+    pthread_t threads[32];
+    struct timespec start;
+    unsigned char uuid[16];
+    generate_uuid(uuid, sizeof(uuid));
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-        off_t disk_size = lseek(fds[i], 0, SEEK_END);
-        if (disk_size < 0) {
-            perror("Failed to get disk size");
-            close(fds[i]);
+    for (int i = 0; i < num_disks; ++i) {
+        jobs[i] = (struct format_job){
+            .path = disk_files[i],
+            .disk_index = i,
+            .num_disks = num_disks,
+            .uuid = uuid,
+            .num_inodes = num_inodes,
+            .num_blocks = num_blocks,
+            .raid_mode = raid_mode,
+            .block_size = block_size,
+            .chunk_size = chunk_size,
+            .journal_size = journal_size,
+            .num_groups = num_groups,
+            .features = features,
+        };
+        if ((errno = pthread_create(&threads[i], NULL, format_disk, &jobs[i])) != 0) {
+            perror("Failed to start format thread");
             exit(EXIT_FAILURE);
         }
+    }
 
-        initialize_superblock(&superblock, num_inodes, num_blocks, raid_mode, disk_size);
-        write_superblock(fds[i], &superblock);
-
-        // Initialize bitmaps
-        initialize_bitmap(fds[i], superblock.i_bitmap_ptr, num_inodes, 0); // Do not allocate inode in initialize_bitmap
-        initialize_bitmap(fds[i], superblock.d_bitmap_ptr, num_blocks, 0); // No data blocks allocated initially
-
-        // Initialize the inode table for each disk
-        initialize_inodes(fds[i], superblock.i_blocks_ptr, superblock.num_inodes);
+    // Every disk must be fully formatted before the root inode goes in
+    for (int i = 0; i < num_disks; ++i) {
+        pthread_join(threads[i], NULL);
+        fds[i] = jobs[i].fd;
     }
+    struct wfs_sb superblock = jobs[0].superblock;
+
+    printf("Formatted %d disks in %.3f s.\n", num_disks, elapsed_since(&start));
 
     // Initialize root inode and allocate it in the inode bitmap
     if (initialize_root_inode(fds, num_disks, &superblock) < 0) {
@@ -0,0 +1,172 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+#define URING_MAX_LEN (1U << 30) // Longest transfer asked for in one operation; the rest follows as a short one would
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_init(struct uring *r, unsigned int entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+
+    r->fd = io_uring_setup(entries, &p);
+    if (r->fd < 0) {
+        return -errno;
+    }
+    // IORING_OP_READ and IORING_OP_WRITE came with the same kernel as this feature
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(r->fd);
+        return -ENOSYS;
+    }
+
+    r->entries = p.sq_entries;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            goto fail;
+        }
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:;
+    int err = -errno;
+    if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring && r->sq_ring != MAP_FAILED) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    close(r->fd);
+    return err;
+}
+
+void uring_close(struct uring *r) {
+    munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if (r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+}
+
+// Put op `i` in the submission queue; the caller makes sure there is room
+static void uring_queue(struct uring *r, const struct uring_op *op, int i) {
+    unsigned int tail = *r->sq_tail;
+    unsigned int slot = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[slot];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = op->fd;
+    sqe->off = op->off;
+    sqe->addr = (uintptr_t)op->buf;
+    sqe->len = op->len < URING_MAX_LEN ? op->len : URING_MAX_LEN;
+    sqe->user_data = i;
+    r->sq_array[slot] = slot;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+int uring_run(struct uring *r, struct uring_op *ops, int n) {
+    int err = 0, next = 0;
+    unsigned int queued = 0, inflight = 0;
+    int failures = 0;
+
+    while (next < n || queued || inflight) {
+        while (next < n && !err && queued + inflight < r->entries) {
+            uring_queue(r, &ops[next], next);
+            ++next;
+            ++queued;
+        }
+
+        // Wait for everything in flight, so a batch that fits the ring costs one call
+        int ret = io_uring_enter(r->fd, queued, queued + inflight, IORING_ENTER_GETEVENTS);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            // Take back what the kernel never saw; only what is already in flight is waited for
+            err = err ? err : -errno;
+            __atomic_store_n(r->sq_tail, *r->sq_tail - queued, __ATOMIC_RELEASE);
+            queued = 0;
+            next = n;
+            if (!inflight || ++failures > 1) {
+                break;
+            }
+            continue;
+        }
+        failures = 0;
+        queued -= ret;
+        inflight += ret;
+
+        unsigned int head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            struct uring_op *op = &ops[cqe->user_data];
+            int res = cqe->res;
+            ++head;
+            --inflight;
+
+            if (res == -EINTR || res == -EAGAIN) {
+                res = 0; // Try the whole thing again
+            } else if (res <= 0) {
+                err = err ? err : (res < 0 ? res : -EIO); // 0 means the file ended under us
+                continue;
+            }
+            op->buf += res;
+            op->off += res;
+            op->len -= res;
+            if (op->len > 0 && !err) {
+                uring_queue(r, op, op - ops);
+                ++queued;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+        if (err) {
+            next = n; // Let what is in flight finish, but start nothing new
+        }
+    }
+    return err;
+}
@@ -0,0 +1,42 @@
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+  A minimal io_uring, set up with the raw system calls so the daemon does
+  not depend on liburing. A ring is used by one thread at a time: queue a
+  set of reads and writes, and uring_run() hands all of them to the
+  kernel in one io_uring_enter() call and reaps every completion before
+  returning. Sets larger than the ring go in as several submissions.
+*/
+
+struct uring {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+};
+
+// One read or write; uring_run() advances it past whatever has completed
+struct uring_op {
+    int fd;
+    int write;
+    char *buf;
+    size_t len;
+    off_t off;
+};
+
+// Set up a ring with room for `entries` operations in flight. Returns 0 or a negative errno.
+int uring_init(struct uring *r, unsigned int entries);
+
+void uring_close(struct uring *r);
+
+/*
+  Carry out all `n` operations, resubmitting short transfers, and wait
+  for every one of them. Returns 0, or the first negative errno reported;
+  a read that hits the end of the file counts as -EIO.
+*/
+int uring_run(struct uring *r, struct uring_op *ops, int n);
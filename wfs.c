@@ -1 +1,3714 @@
 #define FUSE_USE_VERSION 30
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <errno.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/falloc.h>
+#include "wfs.h"
+#include "bitmap.h"
+#include "dcache.h"
+#include "journal.h"
+#include "uring.h"
+#include "crc32c.h"
+
+#define MAX_DISKS (32)
+#define DCACHE_SIZE (16384) // Directory lookups remembered
+
+/*
+  Every disk image given on the command line is mapped in full with mmap.
+  Inodes, bitmaps and data blocks are resolved as pointers into the
+  mappings, and reads copy straight from there into the buffer FUSE hands
+  us, so a lookup or a read costs no syscalls at all.
+
+  Everything in front of the data region (superblock, bitmaps, inodes) is
+  identical on every disk and is resolved in the first disk's mapping;
+  each modified range is copied into the other mappings at the same
+  offset. Data blocks are mirrored the same way in RAID 1. In RAID 0 the
+  logical data region is cut into chunks of `chunk_size` bytes dealt out
+  to the disks in turn, and a data block lives on exactly one disk.
+
+  With the journal, each disk is mapped a second time, privately, and
+  all metadata is read and written through that view. Changes there
+  never reach the file on their own; they get there when the journal
+  commits them. File data keeps going through the shared view.
+*/
+
+// A mapped disk image
+struct wfs_disk {
+    int fd;
+    char *map;  /* Shared view, for file data */
+    char *meta; /* View for metadata: private with the journal, otherwise the same as map */
+    size_t size;
+    long inflight; /* Bytes queued for reading from this disk right now */
+    off_t last;    /* Where the last read from this disk ended */
+    unsigned long reads, read_bytes, writes, write_bytes; /* File data pieces moved, for STATS_PATH */
+    unsigned long busy_ns; /* Time spent copying them, with the mmap backend */
+};
+
+struct wfs_disk disks[MAX_DISKS];
+int num_disks = 0;
+struct wfs_sb *sb; // Superblock of the first disk
+size_t block_size; // sb->block_size, read once at mount
+int var_dentries;  // Directory blocks hold wfs_dirent records rather than wfs_dentry slots
+size_t name_max;   // Longest name a directory entry takes
+struct bitmap inode_map, data_map;
+
+/*
+  Locking. FUSE calls in from several threads at once. Operations that
+  change the namespace (create, remove, rename) hold tree_lock for
+  writing; everything else holds it for reading, so directories stay put
+  under a path walk and lookups run concurrently. A file's contents and
+  attributes are guarded by its inode's reader/writer lock, taken after
+  tree_lock, so independent files are read and written in parallel.
+  Bitmap bits are claimed with atomic operations and need no lock. The
+  data cache has cache_lock, which is taken last and never held while
+  taking another.
+*/
+#define INODE_LOCKS (1024) // Inodes share a lock only when their numbers are this far apart
+
+pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t inode_locks[INODE_LOCKS];
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+  With the journal, every operation that changes metadata holds
+  journal_lock for reading, so a commit, which holds it for writing,
+  sees only whole operations. Blocks freed since the last commit stay
+  allocated until it happens, so nothing the committed metadata still
+  points at is overwritten before the frees are durable.
+*/
+int journaled = 0;
+pthread_rwlock_t journal_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+off_t *pending_frees;
+size_t num_pending, pending_cap;
+
+// Sequential readahead window limits
+#define RA_MIN (16 * block_size)
+#define RA_MAX (1 << 20)
+
+// Per-open-file state, kept in fi->fh
+struct wfs_file {
+    off_t next;       /* Offset a sequential reader would ask for next */
+    size_t ra_window; /* Current readahead size in bytes, 0 when reads are random */
+    char *stats;      /* For STATS_PATH: the snapshot taken at open */
+    size_t stats_len;
+    int ino;          /* Inode opened */
+    int speculated;   /* Writes through this handle reserved blocks past EOF */
+};
+
+/*
+  Instrumentation. Hot operations count calls and time spent, with a
+  histogram of latencies in power-of-two microsecond buckets; the cache
+  and every disk keep plain counters. All of it is bumped with relaxed
+  atomics, and read back as text through a virtual file in the root that
+  never appears on disk or in directory listings.
+*/
+#define STATS_PATH "/.wfs_stats"
+#define LAT_BUCKETS (32) // Bucket i counts operations under 2^i microseconds
+
+enum {
+    ST_GETATTR, ST_LOOKUP, ST_READDIR, ST_READ, ST_WRITE, ST_FSYNC,
+    ST_INODE_SCAN, ST_BLOCK_SCAN, ST_COMMIT, NUM_OP_STATS
+};
+
+struct op_stats {
+    const char *name;
+    unsigned long count;
+    unsigned long total_ns;
+    unsigned long hist[LAT_BUCKETS];
+};
+
+struct op_stats op_stats[NUM_OP_STATS] = {
+    [ST_GETATTR] = { "getattr" },
+    [ST_LOOKUP] = { "lookup" },
+    [ST_READDIR] = { "readdir" },
+    [ST_READ] = { "read" },
+    [ST_WRITE] = { "write" },
+    [ST_FSYNC] = { "fsync" },
+    [ST_INODE_SCAN] = { "inode_bitmap_scan" },
+    [ST_BLOCK_SCAN] = { "data_bitmap_scan" },
+    [ST_COMMIT] = { "commit" },
+};
+
+struct cache_stats {
+    unsigned long hits, misses;
+    unsigned long written;   /* Dirty blocks written back */
+    unsigned long evictions;
+};
+
+struct cache_stats cache_stats;
+struct timespec mount_time;
+
+struct scrub_stats {
+    unsigned long passes;     /* Full passes finished since mount */
+    unsigned long bytes;      /* Bytes compared, per copy */
+    unsigned long mismatches; /* Pieces whose copies differed when first read */
+    unsigned long repaired;   /* Copies overwritten because they still differed once writers were held off */
+};
+
+struct scrub_stats scrub_stats;
+unsigned long csum_errors; // Copies of data blocks found not to match their checksums
+
+#define PTRS_PER_BLOCK (block_size / sizeof(off_t))
+#define DENTRIES_PER_BLOCK (block_size / sizeof(struct wfs_dentry))
+
+// Mount options understood by the daemon itself, given as -o name=value
+struct wfs_options {
+    unsigned long cache_kb;      /* Write-back cache size, 0 to write through */
+    unsigned int flush_interval; /* Seconds between background cache flushes */
+    char *io;                    /* I/O backend for file data: "mmap" or "uring" */
+    unsigned long prealloc_kb;   /* Most an appending writer reserves ahead of EOF, 0 to disable */
+    unsigned long scrub_kb;      /* RAID 1 scrub read bandwidth in KB/s, 0 for no scrub */
+    unsigned int scrub_interval; /* Seconds between the end of one scrub pass and the next */
+};
+
+struct wfs_options options = {
+    .cache_kb = 1024,
+    .flush_interval = 5,
+    .io = "mmap",
+    .prealloc_kb = 1024,
+    .scrub_kb = 0,
+    .scrub_interval = 7 * 24 * 3600,
+};
+
+const struct fuse_opt wfs_opts[] = {
+    { "cache_size=%lu", offsetof(struct wfs_options, cache_kb), 0 },
+    { "flush_interval=%u", offsetof(struct wfs_options, flush_interval), 0 },
+    { "io=%s", offsetof(struct wfs_options, io), 0 },
+    { "prealloc=%lu", offsetof(struct wfs_options, prealloc_kb), 0 },
+    { "scrub_rate=%lu", offsetof(struct wfs_options, scrub_kb), 0 },
+    { "scrub_interval=%u", offsetof(struct wfs_options, scrub_interval), 0 },
+    FUSE_OPT_END
+};
+
+void print_usage(const char *progname) {
+    fprintf(stderr, "Usage: %s <disk1> <disk2> ... [FUSE options] <mount_point>\n", progname);
+    fprintf(stderr, "  -o cache_size=<KB>        write-back cache for file data (default %lu, 0 disables)\n", options.cache_kb);
+    fprintf(stderr, "  -o flush_interval=<secs>  how often dirty cached data is written out (default %u)\n", options.flush_interval);
+    fprintf(stderr, "  -o io=<mmap|uring>        how file data reaches the disks (default mmap)\n");
+    fprintf(stderr, "  -o prealloc=<KB>          space reserved ahead of appending writers (default %lu, 0 disables)\n", options.prealloc_kb);
+    fprintf(stderr, "  -o scrub_rate=<KB/s>      check and repair RAID 1 mirrors in the background at this rate (default off)\n");
+    fprintf(stderr, "  -o scrub_interval=<secs>  pause between scrub passes (default %u)\n", options.scrub_interval);
+    exit(EXIT_FAILURE);
+}
+
+unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void stat_add(unsigned long *counter, unsigned long n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+// Account one operation of kind `op` that started at `start` (from now_ns())
+void stats_end(int op, unsigned long start) {
+    struct op_stats *st = &op_stats[op];
+    unsigned long ns = now_ns() - start;
+    unsigned long us = ns / 1000;
+    int bucket = us ? 64 - __builtin_clzl(us) : 0;
+    if (bucket >= LAT_BUCKETS) {
+        bucket = LAT_BUCKETS - 1;
+    }
+    stat_add(&st->count, 1);
+    stat_add(&st->total_ns, ns);
+    stat_add(&st->hist[bucket], 1);
+}
+
+// Upper bound in microseconds of the bucket holding fraction `p` of the operations
+unsigned long stats_percentile(const unsigned long *hist, unsigned long count, double p) {
+    unsigned long seen = 0;
+    for (int i = 0; i < LAT_BUCKETS; ++i) {
+        seen += hist[i];
+        if (seen > 0 && seen >= p * count) {
+            return 1UL << i;
+        }
+    }
+    return 1UL << (LAT_BUCKETS - 1);
+}
+
+// Render every counter as key=value lines into a new buffer; returns its length, or -ENOMEM
+long stats_format(char **out) {
+    size_t len;
+    FILE *f = open_memstream(out, &len);
+    if (!f) {
+        return -ENOMEM;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(f, "uptime_s=%ld\n", (long)(now.tv_sec - mount_time.tv_sec));
+    for (int i = 0; i < NUM_OP_STATS; ++i) {
+        struct op_stats snap;
+        __atomic_load(&op_stats[i].count, &snap.count, __ATOMIC_RELAXED);
+        __atomic_load(&op_stats[i].total_ns, &snap.total_ns, __ATOMIC_RELAXED);
+        for (int b = 0; b < LAT_BUCKETS; ++b) {
+            snap.hist[b] = __atomic_load_n(&op_stats[i].hist[b], __ATOMIC_RELAXED);
+        }
+        fprintf(f, "op=%s count=%lu total_us=%lu avg_us=%.1f p50_us=%lu p99_us=%lu hist=",
+                op_stats[i].name, snap.count, snap.total_ns / 1000,
+                snap.count ? snap.total_ns / 1000.0 / snap.count : 0.0,
+                snap.count ? stats_percentile(snap.hist, snap.count, 0.50) : 0,
+                snap.count ? stats_percentile(snap.hist, snap.count, 0.99) : 0);
+        const char *sep = "";
+        for (int b = 0; b < LAT_BUCKETS; ++b) {
+            if (snap.hist[b]) {
+                fprintf(f, "%s%lu:%lu", sep, 1UL << b, snap.hist[b]);
+                sep = ",";
+            }
+        }
+        fprintf(f, "\n");
+    }
+    fprintf(f, "cache hits=%lu misses=%lu written=%lu evictions=%lu\n",
+            __atomic_load_n(&cache_stats.hits, __ATOMIC_RELAXED),
+            __atomic_load_n(&cache_stats.misses, __ATOMIC_RELAXED),
+            __atomic_load_n(&cache_stats.written, __ATOMIC_RELAXED),
+            __atomic_load_n(&cache_stats.evictions, __ATOMIC_RELAXED));
+    for (int d = 0; d < num_disks; ++d) {
+        fprintf(f, "disk=%d reads=%lu read_bytes=%lu writes=%lu write_bytes=%lu busy_us=%lu\n", d,
+                __atomic_load_n(&disks[d].reads, __ATOMIC_RELAXED),
+                __atomic_load_n(&disks[d].read_bytes, __ATOMIC_RELAXED),
+                __atomic_load_n(&disks[d].writes, __ATOMIC_RELAXED),
+                __atomic_load_n(&disks[d].write_bytes, __ATOMIC_RELAXED),
+                __atomic_load_n(&disks[d].busy_ns, __ATOMIC_RELAXED) / 1000);
+    }
+    if (sb->features & WFS_FEATURE_CHECKSUMS) {
+        fprintf(f, "checksums impl=%s errors=%lu\n", crc32c_impl(), __atomic_load_n(&csum_errors, __ATOMIC_RELAXED));
+    }
+    if (sb->raid_mode == 1) {
+        fprintf(f, "scrub passes=%lu bytes=%lu mismatches=%lu repaired=%lu pos=%ld last_done=%ld\n",
+                __atomic_load_n(&scrub_stats.passes, __ATOMIC_RELAXED),
+                __atomic_load_n(&scrub_stats.bytes, __ATOMIC_RELAXED),
+                __atomic_load_n(&scrub_stats.mismatches, __ATOMIC_RELAXED),
+                __atomic_load_n(&scrub_stats.repaired, __ATOMIC_RELAXED),
+                (long)__atomic_load_n(&sb->scrub_pos, __ATOMIC_RELAXED),
+                (long)__atomic_load_n(&sb->scrub_done, __ATOMIC_RELAXED));
+    }
+    if (fclose(f) != 0) {
+        return -ENOMEM;
+    }
+    return len;
+}
+
+int is_stats_path(const char *path) {
+    return strcmp(path, STATS_PATH) == 0;
+}
+
+// Copy a modified range of the first disk's mapping into every mirror
+void mirror_range(const void *ptr, size_t len) {
+    const char *p = ptr;
+    int disk = 0;
+    while (disk < num_disks && (p < disks[disk].meta || p >= disks[disk].meta + disks[disk].size)) {
+        ++disk;
+    }
+    int meta = disk < num_disks;
+    if (!meta) {
+        if (p < disks[0].map || p >= disks[0].map + disks[0].size) {
+            return; // A striped block on another disk
+        }
+        disk = 0;
+    }
+
+    size_t off = p - (meta ? disks[disk].meta : disks[disk].map);
+    int striped = sb->raid_mode == 0 && off >= (size_t)sb->d_blocks_ptr; // Striped blocks have no copies
+    if (meta) {
+        journal_dirty(striped ? disk : -1, off, len);
+    }
+    if (disk != 0 || striped) {
+        return;
+    }
+    for (int i = 1; i < num_disks; ++i) {
+        char *view = meta ? disks[i].meta : disks[i].map;
+        memcpy(view + off, ptr, len);
+        if (off < sizeof(struct wfs_sb)) {
+            ((struct wfs_sb *)view)->disk_index = i; // Each superblock keeps its own position
+        }
+    }
+}
+
+pthread_rwlock_t *inode_lock(struct wfs_inode *inode) {
+    return &inode_locks[inode->num % INODE_LOCKS];
+}
+
+struct wfs_inode *inode_at(int num) {
+    return (struct wfs_inode *)(disks[0].meta + sb->i_blocks_ptr + (off_t)num * sb->inode_size);
+}
+
+/*
+  Find the disk holding logical offset `off` and the offset it has there.
+  With striping, *len is cut so the range stays inside one chunk. Data
+  offsets in blocks[] and extents are logical: they number the data blocks
+  as if the whole data region sat on a single disk.
+*/
+int locate(off_t off, size_t *len, off_t *disk_off) {
+    if (sb->raid_mode != 0 || off < sb->d_blocks_ptr) {
+        *disk_off = off;
+        return 0;
+    }
+
+    off_t rel = off - sb->d_blocks_ptr;
+    off_t chunk = rel / sb->chunk_size;
+    size_t left = sb->chunk_size - rel % sb->chunk_size;
+    if (*len > left) {
+        *len = left;
+    }
+    *disk_off = sb->d_blocks_ptr + chunk / num_disks * sb->chunk_size + rel % sb->chunk_size;
+    return chunk % num_disks;
+}
+
+// Metadata blocks are resolved here: directory, index and mapping blocks
+char *block_at(off_t off) {
+    size_t len = block_size;
+    off_t disk_off;
+    int disk = locate(off, &len, &disk_off);
+    return disks[disk].meta + disk_off;
+}
+
+// File data blocks are resolved here
+char *data_at(off_t off) {
+    size_t len = block_size;
+    off_t disk_off;
+    int disk = locate(off, &len, &disk_off);
+    return disks[disk].map + disk_off;
+}
+
+/*
+  Data block checksums (WFS_FEATURE_CHECKSUMS). The table is kept in the
+  shared mappings, next to the data, rather than in the journaled
+  metadata view: data is written in place outside the journal, and an
+  entry that only changed at the next commit would not match its block
+  after a crash in between. Disk 0's table is the one consulted; the
+  other disks get copies like any other metadata.
+*/
+int checksums;
+uint32_t zero_csum; // Checksum of an all-zero block
+
+uint32_t *csum_entry(off_t off) {
+    return (uint32_t *)(disks[0].map + sb->c_blocks_ptr) + (off - sb->d_blocks_ptr) / block_size;
+}
+
+// Record a data block's checksum; CSUM_NONE turns checking the block off
+void csum_store(off_t off, uint32_t crc) {
+    uint32_t *entry = csum_entry(off);
+    *entry = crc;
+    mirror_range(entry, sizeof(*entry));
+}
+
+// Record the checksum of the block at logical offset `off` as it is on disk now
+void csum_update(off_t off) {
+    if (checksums) {
+        csum_store(off, crc32c(0, data_at(off), block_size));
+    }
+}
+
+// Whether `disk`'s copy of the block at logical offset `off`, found at `disk_off` there, is intact
+int csum_ok(int disk, off_t disk_off, off_t off) {
+    uint32_t want = *csum_entry(off);
+    if (want == CSUM_NONE || crc32c(0, disks[disk].map + disk_off, block_size) == want) {
+        return 1;
+    }
+    stat_add(&csum_errors, 1);
+    fprintf(stderr, "Checksum mismatch in data block %ld on disk %d.\n", (long)((off - sb->d_blocks_ptr) / block_size), disk);
+    return 0;
+}
+
+// A mirror whose copy of the block at `off` is intact, trying `first` first, or -1 if none is
+int csum_good_mirror(off_t off, int first) {
+    for (int n = 0; n < num_disks; ++n) {
+        int disk = (first + n) % num_disks;
+        if (csum_ok(disk, off, off)) {
+            return disk;
+        }
+    }
+    return -1;
+}
+
+
+/*
+  File data moves in batches. A read or write is broken into pieces that
+  each land on a single disk. When a request spans several disks and is
+  large enough to be worth the hand-off, each disk's pieces are copied by
+  that disk's worker thread, so the disks work in parallel.
+*/
+#define IO_PARALLEL_MIN (64 * 1024)
+
+// RAID 1 reads at least this big are spread over all mirrors in pieces of this size
+#define MIRROR_SPLIT (64 * 1024)
+
+// One piece of a request: a copy between a FUSE buffer and one disk
+struct io_vec {
+    off_t off; /* Offset on the disk */
+    char *buf; /* Caller's side of the copy */
+    size_t len;
+};
+
+struct io_batch {
+    int write;
+    struct io_vec *vecs[MAX_DISKS];
+    int count[MAX_DISKS];
+    int cap[MAX_DISKS];
+    size_t bytes;
+
+    int pending; /* Workers still busy with this batch */
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    struct io_batch *next[MAX_DISKS]; /* Links in each worker's queue */
+};
+
+struct io_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct io_batch *head, *tail;
+};
+
+struct io_worker workers[MAX_DISKS];
+int workers_started = 0;
+
+void batch_init(struct io_batch *b, int write) {
+    memset(b, 0, sizeof(*b));
+    b->write = write;
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->done, NULL);
+}
+
+void batch_free(struct io_batch *b) {
+    for (int i = 0; i < num_disks; ++i) {
+        free(b->vecs[i]);
+    }
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->done);
+}
+
+// Queue a piece for one disk, merging it into the previous piece when both sides line up
+int batch_add(struct io_batch *b, int disk, off_t off, char *buf, size_t len) {
+    int n = b->count[disk];
+    struct io_vec *last = n ? &b->vecs[disk][n - 1] : NULL;
+    b->bytes += len;
+
+    if (last && last->off + (off_t)last->len == off && last->buf + last->len == buf) {
+        last->len += len;
+        return 0;
+    }
+    if (n == b->cap[disk]) {
+        int cap = n ? n * 2 : 8;
+        struct io_vec *vecs = realloc(b->vecs[disk], cap * sizeof(*vecs));
+        if (!vecs) {
+            return -ENOMEM;
+        }
+        b->vecs[disk] = vecs;
+        b->cap[disk] = cap;
+    }
+    b->vecs[disk][n] = (struct io_vec){ off, buf, len };
+    b->count[disk]++;
+    return 0;
+}
+
+/*
+  Choose the mirror to read `off` from: the one with the fewest bytes in
+  flight, then the one whose last read ended closest to `off`. Remaining
+  ties rotate so idle mirrors share the load.
+*/
+int pick_mirror(off_t off) {
+    static unsigned int rotor;
+    int start = __atomic_fetch_add(&rotor, 1, __ATOMIC_RELAXED) % num_disks;
+    int best = start;
+    long best_load = LONG_MAX;
+    off_t best_dist = 0;
+
+    for (int n = 0; n < num_disks; ++n) {
+        int i = (start + n) % num_disks;
+        long load = __atomic_load_n(&disks[i].inflight, __ATOMIC_RELAXED);
+        off_t last = __atomic_load_n(&disks[i].last, __ATOMIC_RELAXED);
+        off_t dist = last > off ? last - off : off - last;
+        if (load < best_load || (load == best_load && dist < best_dist)) {
+            best = i;
+            best_load = load;
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+// Queue a RAID 1 read, spreading a large one across the mirrors
+int batch_add_mirror_read(struct io_batch *b, off_t off, char *buf, size_t len) {
+    int disk = pick_mirror(off);
+    while (len > 0) {
+        size_t piece = len < MIRROR_SPLIT ? len : MIRROR_SPLIT - (off % MIRROR_SPLIT);
+        if (piece > len) {
+            piece = len;
+        }
+        int err = batch_add(b, disk, off, buf, piece);
+        if (err < 0) {
+            return err;
+        }
+        disk = (disk + 1) % num_disks;
+        off += piece;
+        buf += piece;
+        len -= piece;
+    }
+    return 0;
+}
+
+// Queue a copy of logical data range `off`, splitting it across disks as the RAID mode requires
+int batch_add_data(struct io_batch *b, off_t off, char *buf, size_t len) {
+    while (len > 0) {
+        size_t piece = len;
+        off_t disk_off;
+        int disk = locate(off, &piece, &disk_off);
+        int err;
+
+        if (sb->raid_mode == 1 && off >= sb->d_blocks_ptr) {
+            if (!b->write) {
+                return batch_add_mirror_read(b, disk_off, buf, len);
+            }
+            for (int i = 0; i < num_disks; ++i) {
+                if ((err = batch_add(b, i, disk_off, buf, piece)) < 0) {
+                    return err;
+                }
+            }
+        } else if ((err = batch_add(b, disk, disk_off, buf, piece)) < 0) {
+            return err;
+        }
+        off += piece;
+        buf += piece;
+        len -= piece;
+    }
+    return 0;
+}
+
+/*
+  Queue a read of file data like batch_add_data(), but with checksums
+  only from copies whose blocks match them. With RAID 1 a bad copy is
+  passed over for another mirror; with no good copy left the read fails
+  with -EIO.
+*/
+int batch_add_read(struct io_batch *b, off_t off, char *buf, size_t len) {
+    if (!checksums) {
+        return batch_add_data(b, off, buf, len);
+    }
+    int first = sb->raid_mode == 1 ? pick_mirror(off) : 0;
+    off_t split = off / MIRROR_SPLIT;
+    while (len > 0) {
+        size_t in = (off - sb->d_blocks_ptr) % block_size;
+        off_t block = off - in;
+        size_t n = block_size - in < len ? block_size - in : len;
+        size_t piece = block_size;
+        off_t disk_off;
+        int disk = locate(block, &piece, &disk_off);
+        if (sb->raid_mode == 1) {
+            // Spread a large read over the mirrors as batch_add_mirror_read() does
+            disk = csum_good_mirror(block, (first + off / MIRROR_SPLIT - split) % num_disks);
+        } else if (!csum_ok(disk, disk_off, block)) {
+            disk = -1;
+        }
+        if (disk < 0) {
+            return -EIO;
+        }
+        int err = batch_add(b, disk, disk_off + in, buf, n);
+        if (err < 0) {
+            return err;
+        }
+        off += n;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void batch_copy(struct io_batch *b, int disk) {
+    unsigned long start = b->count[disk] ? now_ns() : 0;
+    for (int i = 0; i < b->count[disk]; ++i) {
+        struct io_vec *v = &b->vecs[disk][i];
+        if (b->write) {
+            memcpy(disks[disk].map + v->off, v->buf, v->len);
+        } else {
+            memcpy(v->buf, disks[disk].map + v->off, v->len);
+            __atomic_store_n(&disks[disk].last, v->off + v->len, __ATOMIC_RELAXED);
+        }
+    }
+    if (start) {
+        stat_add(&disks[disk].busy_ns, now_ns() - start);
+    }
+}
+
+// Track how many bytes each disk has queued so pick_mirror() can steer reads, and count what each disk moved
+void batch_account(struct io_batch *b, int sign) {
+    for (int i = 0; i < num_disks; ++i) {
+        long bytes = 0;
+        for (int j = 0; j < b->count[i]; ++j) {
+            bytes += b->vecs[i][j].len;
+        }
+        if (!b->write) {
+            __atomic_add_fetch(&disks[i].inflight, sign * bytes, __ATOMIC_RELAXED);
+        }
+        if (sign < 0 && b->count[i]) {
+            stat_add(b->write ? &disks[i].writes : &disks[i].reads, b->count[i]);
+            stat_add(b->write ? &disks[i].write_bytes : &disks[i].read_bytes, bytes);
+        }
+    }
+}
+
+void *io_worker_main(void *arg) {
+    struct io_worker *w = arg;
+    int disk = w - workers;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->head) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+        struct io_batch *b = w->head;
+        if (!(w->head = b->next[disk])) {
+            w->tail = NULL;
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        batch_copy(b, disk);
+
+        pthread_mutex_lock(&b->lock);
+        if (--b->pending == 0) {
+            pthread_cond_signal(&b->done);
+        }
+        pthread_mutex_unlock(&b->lock);
+        pthread_mutex_lock(&w->lock);
+    }
+    return NULL;
+}
+
+void start_io_workers(void) {
+    for (int i = 0; i < num_disks; ++i) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        pthread_cond_init(&workers[i].wake, NULL);
+        if (pthread_create(&workers[i].thread, NULL, io_worker_main, &workers[i]) != 0) {
+            perror("Failed to start I/O worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+    workers_started = 1;
+}
+
+// The mmap backend: copy to and from the mappings, on the disks' workers when that pays
+int mmap_run(struct io_batch *b) {
+    int busy = 0;
+    for (int i = 0; i < num_disks; ++i) {
+        busy += b->count[i] > 0;
+    }
+
+    if (!workers_started || busy < 2 || b->bytes < IO_PARALLEL_MIN) {
+        for (int i = 0; i < num_disks; ++i) {
+            batch_copy(b, i);
+        }
+        return 0;
+    }
+
+    b->pending = busy;
+    for (int i = 0; i < num_disks; ++i) {
+        if (!b->count[i]) {
+            continue;
+        }
+        struct io_worker *w = &workers[i];
+        pthread_mutex_lock(&w->lock);
+        b->next[i] = NULL;
+        if (w->tail) {
+            w->tail->next[i] = b;
+        } else {
+            w->head = b;
+        }
+        w->tail = b;
+        pthread_cond_signal(&w->wake);
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    pthread_mutex_lock(&b->lock);
+    while (b->pending) {
+        pthread_cond_wait(&b->done, &b->lock);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return 0;
+}
+
+/*
+  The io_uring backend: every piece becomes a read or write on its disk's
+  file, and the pieces for all disks go to the kernel in one submission
+  from the calling thread, so a write mirrored to N disks costs one
+  system call instead of N. The page cache keeps the mappings coherent
+  with these writes. Each thread gets its own ring the first time it
+  needs one.
+*/
+#define URING_ENTRIES (64)
+
+pthread_key_t ring_key;
+
+void ring_destroy(void *ring) {
+    uring_close(ring);
+    free(ring);
+}
+
+struct uring *thread_ring(void) {
+    struct uring *r = pthread_getspecific(ring_key);
+    if (!r && (r = malloc(sizeof(*r)))) {
+        if (uring_init(r, URING_ENTRIES) < 0 || pthread_setspecific(ring_key, r) != 0) {
+            free(r);
+            r = NULL;
+        }
+    }
+    return r;
+}
+
+int uring_batch_run(struct io_batch *b) {
+    struct uring *r = thread_ring();
+    int n = 0;
+    for (int i = 0; i < num_disks; ++i) {
+        n += b->count[i];
+    }
+    struct uring_op *ops = malloc(n * sizeof(*ops));
+    if (!r || !ops) {
+        free(ops);
+        return mmap_run(b); // Better slow than failed
+    }
+
+    n = 0;
+    for (int i = 0; i < num_disks; ++i) {
+        for (int j = 0; j < b->count[i]; ++j) {
+            struct io_vec *v = &b->vecs[i][j];
+            ops[n++] = (struct uring_op){ disks[i].fd, b->write, v->buf, v->len, v->off };
+        }
+        if (!b->write && b->count[i]) {
+            struct io_vec *v = &b->vecs[i][b->count[i] - 1];
+            __atomic_store_n(&disks[i].last, v->off + v->len, __ATOMIC_RELAXED);
+        }
+    }
+    int err = uring_run(r, ops, n);
+    free(ops);
+    return err;
+}
+
+struct io_backend {
+    const char *name;
+    int (*run)(struct io_batch *b);
+};
+
+const struct io_backend backends[] = {
+    { "mmap", mmap_run },
+    { "uring", uring_batch_run },
+};
+
+const struct io_backend *backend = &backends[0];
+
+// Carry out every piece of a batch and wait for all of them. Returns 0 or a negative errno.
+int batch_run(struct io_batch *b) {
+    batch_account(b, 1);
+    int err = backend->run(b);
+    batch_account(b, -1);
+    return err;
+}
+
+// Pick the backend named by -o io=, falling back to mmap if this kernel can't do io_uring. Returns -1 for an unknown name.
+int select_backend(const char *name) {
+    size_t i = 0;
+    while (i < sizeof(backends) / sizeof(backends[0]) && strcmp(backends[i].name, name) != 0) {
+        ++i;
+    }
+    if (i == sizeof(backends) / sizeof(backends[0])) {
+        fprintf(stderr, "Unknown I/O backend: %s\n", name);
+        return -1;
+    }
+    backend = &backends[i];
+
+    if (backend->run == uring_batch_run) {
+        struct uring probe;
+        int err = uring_init(&probe, URING_ENTRIES);
+        if (err < 0) {
+            fprintf(stderr, "io_uring is not available (%s), using mmap.\n", strerror(-err));
+            backend = &backends[0];
+            return 0;
+        }
+        uring_close(&probe);
+        pthread_key_create(&ring_key, ring_destroy);
+    }
+    return 0;
+}
+
+/*
+  Write-back cache for file data. Writes land in cached copies of their
+  blocks and are marked dirty; reads check the cache before going to the
+  disks. Dirty blocks are written out together: on fsync and unmount,
+  from a timer, and whenever a dirty block has to be evicted. A flush puts
+  all of them in one batch sorted by offset, so adjacent blocks end up as
+  one list of copies per disk and each mirror is touched once per flush
+  instead of once per small write.
+*/
+struct cache_block {
+    off_t off; /* Logical data offset of the block */
+    int dirty;
+    char *data;
+    struct cache_block *hash_next;
+    struct cache_block *lru_prev, *lru_next;
+};
+
+struct cache_block *cache_pool;
+struct cache_block **cache_buckets;
+size_t cache_capacity, cache_num_buckets, cache_used;
+struct cache_block *cache_free;
+struct cache_block cache_lru; // Sentinel: cache_lru.lru_next is the most recently used
+
+void cache_init(size_t capacity) {
+    cache_capacity = capacity;
+    cache_lru.lru_prev = cache_lru.lru_next = &cache_lru;
+    if (!capacity) {
+        return;
+    }
+
+    cache_num_buckets = 1;
+    while (cache_num_buckets < capacity * 2) {
+        cache_num_buckets <<= 1;
+    }
+    cache_pool = calloc(capacity, sizeof(*cache_pool));
+    cache_buckets = calloc(cache_num_buckets, sizeof(*cache_buckets));
+    char *data = malloc(capacity * block_size);
+    if (!cache_pool || !cache_buckets || !data) {
+        perror("Failed to allocate block cache");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        cache_pool[i].data = data + i * block_size;
+        cache_pool[i].hash_next = cache_free;
+        cache_free = &cache_pool[i];
+    }
+}
+
+struct cache_block **cache_slot(off_t off) {
+    struct cache_block **link = &cache_buckets[(off / block_size) & (cache_num_buckets - 1)];
+    while (*link && (*link)->off != off) {
+        link = &(*link)->hash_next;
+    }
+    return link;
+}
+
+struct cache_block *cache_find(off_t off) {
+    return cache_used ? *cache_slot(off) : NULL;
+}
+
+void cache_touch(struct cache_block *cb) {
+    cb->lru_prev->lru_next = cb->lru_next;
+    cb->lru_next->lru_prev = cb->lru_prev;
+    cb->lru_next = cache_lru.lru_next;
+    cb->lru_prev = &cache_lru;
+    cache_lru.lru_next->lru_prev = cb;
+    cache_lru.lru_next = cb;
+}
+
+void cache_remove(struct cache_block *cb) {
+    *cache_slot(cb->off) = cb->hash_next;
+    cb->lru_prev->lru_next = cb->lru_next;
+    cb->lru_next->lru_prev = cb->lru_prev;
+    cb->hash_next = cache_free;
+    cache_free = cb;
+    cache_used--;
+}
+
+int cache_cmp(const void *a, const void *b) {
+    off_t x = (*(struct cache_block *const *)a)->off, y = (*(struct cache_block *const *)b)->off;
+    return (x > y) - (x < y);
+}
+
+// Write every dirty block out in one batch; the caller holds cache_lock
+void cache_write_back(void) {
+    struct cache_block **dirty = malloc(cache_used * sizeof(*dirty));
+    size_t n = 0;
+    if (!dirty) {
+        return;
+    }
+    for (struct cache_block *cb = cache_lru.lru_next; cb != &cache_lru; cb = cb->lru_next) {
+        if (cb->dirty) {
+            dirty[n++] = cb;
+        }
+    }
+    qsort(dirty, n, sizeof(*dirty), cache_cmp);
+
+    struct io_batch batch;
+    batch_init(&batch, 1);
+    for (size_t i = 0; i < n; ++i) {
+        batch_add_data(&batch, dirty[i]->off, dirty[i]->data, block_size);
+        dirty[i]->dirty = 0;
+    }
+    if (batch_run(&batch) < 0) {
+        // Keep the blocks dirty so the next flush tries again
+        for (size_t i = 0; i < n; ++i) {
+            dirty[i]->dirty = 1;
+        }
+    } else {
+        stat_add(&cache_stats.written, n);
+        for (size_t i = 0; checksums && i < n; ++i) {
+            csum_store(dirty[i]->off, crc32c(0, dirty[i]->data, block_size));
+        }
+    }
+    batch_free(&batch);
+    free(dirty);
+}
+
+void cache_flush(void) {
+    pthread_mutex_lock(&cache_lock);
+    cache_write_back();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Get the cached copy of the block at `off`, reading it in first unless `whole` says it will be overwritten
+struct cache_block *cache_get(off_t off, int whole) {
+    struct cache_block *cb = cache_find(off);
+    if (cb) {
+        stat_add(&cache_stats.hits, 1);
+        cache_touch(cb);
+        return cb;
+    }
+
+    stat_add(&cache_stats.misses, 1);
+    if (!cache_free) {
+        struct cache_block *victim = cache_lru.lru_prev;
+        if (victim->dirty) {
+            cache_write_back();
+        }
+        cache_remove(victim);
+        stat_add(&cache_stats.evictions, 1);
+    }
+    cb = cache_free;
+    cache_free = cb->hash_next;
+    cache_used++;
+
+    cb->off = off;
+    cb->dirty = 0;
+    cb->hash_next = NULL;
+    *cache_slot(off) = cb;
+    cb->lru_next = cb->lru_prev = cb;
+    cache_touch(cb);
+    if (!whole) {
+        memcpy(cb->data, data_at(off), block_size);
+    }
+    return cb;
+}
+
+// Forget a block that is being freed, so a later flush can't overwrite its next owner
+void cache_drop(off_t off) {
+    pthread_mutex_lock(&cache_lock);
+    struct cache_block *cb = cache_find(off);
+    if (cb) {
+        cache_remove(cb);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+  Copy an intact mirror of the block at `off` over any copy that is not,
+  before part of the block is rewritten; otherwise the new checksum would
+  cover whatever was wrong with the first disk's copy. The caller holds
+  the file's inode lock for writing.
+*/
+void csum_heal(off_t off) {
+    if (!checksums || sb->raid_mode != 1) {
+        return;
+    }
+    pthread_mutex_lock(&cache_lock);
+    // A cached block is written back whole, whatever the disks hold
+    if (!cache_find(off)) {
+        int good = csum_good_mirror(off, 0);
+        for (int disk = 0; good >= 0 && disk < num_disks; ++disk) {
+            if (disk != good && memcmp(disks[disk].map + off, disks[good].map + off, block_size) != 0) {
+                memcpy(disks[disk].map + off, disks[good].map + off, block_size);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+  Allocation groups. A file's inode goes in its parent directory's group
+  and its blocks in the inode's group, so a directory's files sit together
+  on disk. New directories are dealt out to the groups in turn, which
+  spreads unrelated trees, and the threads working in them, over
+  different parts of the bitmaps. Without WFS_FEATURE_GROUPS the whole
+  filesystem is one group.
+*/
+size_t num_groups = 1;
+size_t inodes_per_group, blocks_per_group;
+unsigned int dir_rotor; // Group for the next new directory
+
+// Each thread allocates from its own place in each group of each bitmap
+__thread struct bitmap_cursor inode_cursors[WFS_MAX_GROUPS], data_cursors[WFS_MAX_GROUPS];
+
+size_t inode_group(const struct wfs_inode *inode) {
+    return inode->num / inodes_per_group;
+}
+
+size_t block_group(off_t off) {
+    return (off - sb->d_blocks_ptr) / block_size / blocks_per_group;
+}
+
+// Apply a claim or release of `bit` to the other disks' copies of the bitmap with the same atomic operation
+void mirror_bit(struct bitmap *bm, size_t bit, int set) {
+    size_t off = (char *)bitmap_word(bm, bit) - disks[0].meta;
+    unsigned int mask = 1U << (bit % 32);
+    journal_dirty(-1, off, sizeof(unsigned int));
+    for (int i = 1; i < num_disks; ++i) {
+        unsigned int *word = (unsigned int *)(disks[i].meta + off);
+        if (set) {
+            __atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_and(word, ~mask, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Claim a free bit, preferring group `group` and moving on to the following groups when it is full
+long claim_bit(struct bitmap *bm, size_t group) {
+    int inodes = bm == &inode_map;
+    size_t per_group = inodes ? inodes_per_group : blocks_per_group;
+    unsigned long start = now_ns();
+    long bit = -1;
+    for (size_t n = 0; n < num_groups && bit < 0; ++n) {
+        size_t g = (group + n) % num_groups;
+        struct bitmap_cursor *cur = inodes ? &inode_cursors[g] : &data_cursors[g];
+        bit = bitmap_alloc_range(bm, cur, g * per_group, g + 1 < num_groups ? (g + 1) * per_group : bm->num_bits);
+    }
+    stats_end(inodes ? ST_INODE_SCAN : ST_BLOCK_SCAN, start);
+    if (bit >= 0) {
+        mirror_bit(bm, bit, 1);
+    }
+    return bit;
+}
+
+void release_bit(struct bitmap *bm, size_t bit) {
+    bitmap_free(bm, bit);
+    mirror_bit(bm, bit, 0);
+}
+
+// Claim one particular bit if it is free
+long claim_bit_at(struct bitmap *bm, size_t bit) {
+    long got = bitmap_alloc_at(bm, bit);
+    if (got >= 0) {
+        mirror_bit(bm, got, 1);
+    }
+    return got;
+}
+
+/*
+  Allocate a zeroed data block and return its disk offset, or 0 if none
+  are left. The block at disk offset `goal` is taken if it is free, so
+  callers that pass the block after a file's previous one keep the file
+  contiguous; pass 0 for no preference. Otherwise the block comes from
+  allocation group `group` if it has room.
+*/
+off_t alloc_block(off_t goal, size_t group) {
+    long b = -1;
+    if (goal >= sb->d_blocks_ptr) {
+        b = claim_bit_at(&data_map, (goal - sb->d_blocks_ptr) / block_size);
+    }
+    if (b < 0 && (b = claim_bit(&data_map, group)) < 0) {
+        return 0;
+    }
+    off_t off = sb->d_blocks_ptr + b * block_size;
+    memset(data_at(off), 0, block_size);
+    mirror_range(data_at(off), block_size);
+    if (checksums) {
+        csum_store(off, zero_csum);
+    }
+    return off;
+}
+
+/*
+  Clear a just-allocated block that will hold metadata in the metadata
+  view too. Metadata changes outside the data path, so the block is left
+  out of checksumming.
+*/
+void init_meta_block(off_t off) {
+    if (journaled) {
+        memset(block_at(off), 0, block_size);
+        mirror_range(block_at(off), block_size);
+    }
+    if (checksums) {
+        csum_store(off, CSUM_NONE);
+    }
+}
+
+off_t alloc_meta_block(size_t group) {
+    off_t off = alloc_block(0, group);
+    if (off) {
+        init_meta_block(off);
+    }
+    return off;
+}
+
+void free_block(off_t off) {
+    cache_drop(off);
+    if (!journaled) {
+        release_bit(&data_map, (off - sb->d_blocks_ptr) / block_size);
+        return;
+    }
+
+    pthread_mutex_lock(&free_lock);
+    if (num_pending == pending_cap) {
+        size_t cap = pending_cap ? pending_cap * 2 : 256;
+        off_t *frees = realloc(pending_frees, cap * sizeof(*frees));
+        if (!frees) {
+            // Leak the block rather than let it be reused before the free commits
+            pthread_mutex_unlock(&free_lock);
+            return;
+        }
+        pending_frees = frees;
+        pending_cap = cap;
+    }
+    pending_frees[num_pending++] = off;
+    pthread_mutex_unlock(&free_lock);
+}
+
+// Allocate an inode near `parent`, or in the next group in turn for a directory
+struct wfs_inode *alloc_inode(mode_t mode, struct wfs_inode *parent) {
+    size_t group = inode_group(parent);
+    if (S_ISDIR(mode) && num_groups > 1) {
+        group = __atomic_fetch_add(&dir_rotor, 1, __ATOMIC_RELAXED) % num_groups;
+    }
+    long num = claim_bit(&inode_map, group);
+    if (num < 0) {
+        return NULL;
+    }
+
+    /*
+      Clear the whole slot: inline data relies on the bytes past the end of
+      the file being zero, and with WFS_FEATURE_LAZY_ITABLE this is the
+      first time the slot is written at all.
+    */
+    struct wfs_inode *inode = inode_at(num);
+    memset(inode, 0, sb->inode_size);
+    inode->num = num;
+    inode->mode = mode;
+    inode->uid = getuid();
+    inode->gid = getgid();
+    inode->nlinks = S_ISDIR(mode) ? 2 : 1;
+    inode->atim = inode->mtim = inode->ctim = time(NULL);
+    if (S_ISREG(mode) && (sb->features & WFS_FEATURE_INLINE_DATA)) {
+        inode->flags = WFS_INODE_INLINE;
+    }
+    mirror_range(inode, sb->inode_size);
+    return inode;
+}
+
+// bmap() for block pointers: blocks 0..D_BLOCK are direct, the rest go through the indirect block
+off_t ptr_bmap(struct wfs_inode *inode, off_t index, int create) {
+    if (index < IND_BLOCK) {
+        if (!inode->blocks[index] && create) {
+            off_t prev = index > 0 ? inode->blocks[index - 1] : 0;
+            if (!(inode->blocks[index] = alloc_block(prev ? prev + block_size : 0, inode_group(inode)))) {
+                return -ENOSPC;
+            }
+            mirror_range(&inode->blocks[index], sizeof(off_t));
+        }
+        return inode->blocks[index];
+    }
+
+    index -= IND_BLOCK;
+    if (index >= (off_t)PTRS_PER_BLOCK) {
+        return -EFBIG;
+    }
+    if (!inode->blocks[IND_BLOCK]) {
+        if (!create) {
+            return 0;
+        }
+        if (!(inode->blocks[IND_BLOCK] = alloc_meta_block(inode_group(inode)))) {
+            return -ENOSPC;
+        }
+        mirror_range(&inode->blocks[IND_BLOCK], sizeof(off_t));
+    }
+
+    off_t *ptrs = (off_t *)block_at(inode->blocks[IND_BLOCK]);
+    if (!ptrs[index] && create) {
+        off_t prev = index > 0 ? ptrs[index - 1] : inode->blocks[IND_BLOCK - 1];
+        if (!(ptrs[index] = alloc_block(prev ? prev + block_size : 0, inode_group(inode)))) {
+            return -ENOSPC;
+        }
+        mirror_range(&ptrs[index], sizeof(off_t));
+    }
+    return ptrs[index];
+}
+
+void ptr_trim(struct wfs_inode *inode, off_t keep) {
+    for (off_t i = keep; i < IND_BLOCK; ++i) {
+        if (inode->blocks[i]) {
+            free_block(inode->blocks[i]);
+            inode->blocks[i] = 0;
+        }
+    }
+
+    if (inode->blocks[IND_BLOCK]) {
+        off_t *ptrs = (off_t *)block_at(inode->blocks[IND_BLOCK]);
+        off_t first = keep > IND_BLOCK ? keep - IND_BLOCK : 0;
+        for (off_t i = first; i < (off_t)PTRS_PER_BLOCK; ++i) {
+            if (ptrs[i]) {
+                free_block(ptrs[i]);
+                ptrs[i] = 0;
+            }
+        }
+        mirror_range(ptrs, block_size);
+        if (first == 0) {
+            free_block(inode->blocks[IND_BLOCK]);
+            inode->blocks[IND_BLOCK] = 0;
+        }
+    }
+    mirror_range(inode->blocks, sizeof(inode->blocks));
+}
+
+// An extent tree node: either the root inside an inode or a whole block
+struct ext_node {
+    struct wfs_extent_header *hdr;
+    struct wfs_extent *ext;
+    int max;
+    size_t group; /* Where new blocks for the tree are allocated */
+};
+
+void ext_root(struct wfs_inode *inode, struct ext_node *node) {
+    node->hdr = (struct wfs_extent_header *)inode->blocks;
+    node->ext = (struct wfs_extent *)(node->hdr + 1);
+    node->max = EXTENTS_IN_INODE;
+    node->group = inode_group(inode);
+}
+
+void ext_child(off_t off, struct ext_node *node) {
+    node->hdr = (struct wfs_extent_header *)block_at(off);
+    node->ext = (struct wfs_extent *)(node->hdr + 1);
+    node->max = EXTENTS_IN_BLOCK(block_size);
+    node->group = block_group(off);
+}
+
+void ext_sync(struct ext_node *node) {
+    mirror_range(node->hdr, sizeof(*node->hdr) + node->max * sizeof(struct wfs_extent));
+}
+
+// Index of the last entry starting at or before `lblk`, or 0 if there is none
+int ext_search(struct ext_node *node, unsigned int lblk) {
+    int i = 0;
+    while (i + 1 < node->hdr->entries && node->ext[i + 1].lblk <= lblk) {
+        ++i;
+    }
+    return i;
+}
+
+// Disk offset of file block `lblk`, or 0 if no extent covers it. If `run`
+// is set, it receives the number of blocks left in the extent from `lblk`.
+off_t ext_lookup(struct wfs_inode *inode, unsigned int lblk, size_t *run) {
+    struct ext_node node;
+    ext_root(inode, &node);
+
+    while (node.hdr->entries) {
+        struct wfs_extent *e = &node.ext[ext_search(&node, lblk)];
+        if (node.hdr->depth == 0) {
+            if (lblk >= e->lblk && lblk - e->lblk < e->len) {
+                if (run) {
+                    *run = e->len - (lblk - e->lblk);
+                }
+                return e->start + (off_t)(lblk - e->lblk) * block_size;
+            }
+            break;
+        }
+        ext_child(e->start, &node);
+    }
+    return 0;
+}
+
+// Blocks taken ahead of an insert for the nodes it will split; the leaf's is on top
+struct ext_spares {
+    off_t *off;
+    int n;
+};
+
+/*
+  Insert `e` at position `pos` of `node`. A full block is split in half;
+  the new right half is described in *split and 1 is returned so the
+  caller can link it in. The root can't split, so when it fills up its
+  entries move down into a new block and the tree grows one level. New
+  blocks come from `spares` first.
+*/
+int ext_add(struct ext_node *node, int pos, const struct wfs_extent *e, int is_root, struct wfs_extent *split, struct ext_spares *spares) {
+    int entries = node->hdr->entries;
+    if (entries < node->max) {
+        memmove(&node->ext[pos + 1], &node->ext[pos], (entries - pos) * sizeof(struct wfs_extent));
+        node->ext[pos] = *e;
+        node->hdr->entries++;
+        ext_sync(node);
+        return 0;
+    }
+
+    off_t off = spares->n ? spares->off[--spares->n] : alloc_meta_block(node->group);
+    if (!off) {
+        return -ENOSPC;
+    }
+    struct ext_node child;
+    ext_child(off, &child);
+
+    if (is_root) {
+        *child.hdr = *node->hdr;
+        memcpy(child.ext, node->ext, entries * sizeof(struct wfs_extent));
+        node->hdr->depth++;
+        node->hdr->entries = 1;
+        node->ext[0] = (struct wfs_extent){ .lblk = child.ext[0].lblk, .start = off };
+        ext_sync(node);
+        return ext_add(&child, pos, e, 0, split, spares);
+    }
+
+    int half = entries / 2;
+    child.hdr->depth = node->hdr->depth;
+    child.hdr->entries = entries - half;
+    memcpy(child.ext, &node->ext[half], (entries - half) * sizeof(struct wfs_extent));
+    node->hdr->entries = half;
+    ext_sync(node);
+    ext_sync(&child);
+
+    if (pos <= half) {
+        ext_add(node, pos, e, 0, NULL, spares);
+    } else {
+        ext_add(&child, pos - half, e, 0, NULL, spares);
+    }
+    *split = (struct wfs_extent){ .lblk = child.ext[0].lblk, .start = off };
+    return 1;
+}
+
+// Whether the run `e` continues the leaf entry `prev`, both in the file and on disk
+int ext_continues(const struct wfs_extent *prev, const struct wfs_extent *e) {
+    return prev->lblk + prev->len == e->lblk && prev->start + (off_t)prev->len * block_size == e->start;
+}
+
+/*
+  Count the new blocks adding the run `e` under `node` will take. A split
+  carries on upwards through every full node from the leaf, and each of
+  those needs a block. groups[k] receives the allocation group of the
+  node k levels above the leaf, where its block should come from.
+*/
+int ext_blocks_needed(struct ext_node *node, const struct wfs_extent *e, size_t *groups) {
+    int levels = node->hdr->depth;
+    int below = 0;
+    if (levels == 0) {
+        struct wfs_extent *prev = &node->ext[ext_search(node, e->lblk)];
+        if (node->hdr->entries && e->lblk >= prev->lblk && ext_continues(prev, e)) {
+            return 0;
+        }
+    } else {
+        struct ext_node child;
+        ext_child(node->ext[ext_search(node, e->lblk)].start, &child);
+        below = ext_blocks_needed(&child, e, groups);
+    }
+    groups[levels] = node->group;
+    // Only a split that went through every level below reaches this node
+    return below == levels && node->hdr->entries == node->max ? below + 1 : below;
+}
+
+// Add the run `e` to the subtree under `node`, growing a neighbouring run where it continues one
+int ext_insert(struct ext_node *node, const struct wfs_extent *e, int is_root, struct wfs_extent *split, struct ext_spares *spares) {
+    int i = ext_search(node, e->lblk);
+
+    if (node->hdr->depth == 0) {
+        struct wfs_extent *prev = &node->ext[i];
+        if (node->hdr->entries == 0 || e->lblk < prev->lblk) {
+            return ext_add(node, 0, e, is_root, split, spares);
+        }
+        if (ext_continues(prev, e)) {
+            prev->len += e->len;
+            ext_sync(node);
+            return 0;
+        }
+        return ext_add(node, i + 1, e, is_root, split, spares);
+    }
+
+    struct ext_node child;
+    struct wfs_extent child_split;
+    ext_child(node->ext[i].start, &child);
+    int err = ext_insert(&child, e, 0, &child_split, spares);
+    if (err <= 0) {
+        return err;
+    }
+    return ext_add(node, i + 1, &child_split, is_root, split, spares);
+}
+
+// Free every block from file block `keep` onwards in the subtree under `node`
+void ext_trim(struct ext_node *node, unsigned int keep) {
+    while (node->hdr->entries) {
+        struct wfs_extent *e = &node->ext[node->hdr->entries - 1];
+
+        if (node->hdr->depth == 0) {
+            if (e->lblk + e->len <= keep) {
+                break;
+            }
+            unsigned int first = e->lblk >= keep ? 0 : keep - e->lblk;
+            for (unsigned int j = first; j < e->len; ++j) {
+                free_block(e->start + (off_t)j * block_size);
+            }
+            if (first) {
+                e->len = first;
+                break;
+            }
+        } else {
+            struct ext_node child;
+            ext_child(e->start, &child);
+            ext_trim(&child, keep);
+            if (child.hdr->entries) {
+                break;
+            }
+            free_block(e->start);
+        }
+        node->hdr->entries--;
+    }
+
+    if (!node->hdr->entries) {
+        node->hdr->depth = 0;
+    }
+    ext_sync(node);
+}
+
+// bmap() for extent trees
+off_t ext_bmap(struct wfs_inode *inode, off_t index, int create) {
+    if (index >= UINT_MAX) {
+        return -EFBIG;
+    }
+    off_t off = ext_lookup(inode, index, NULL);
+    if (off || !create) {
+        return off;
+    }
+
+    // Try to place the block right after the previous one so the run just grows
+    off_t prev = index > 0 ? ext_lookup(inode, index - 1, NULL) : 0;
+    if (!(off = alloc_block(prev ? prev + block_size : 0, inode_group(inode)))) {
+        return -ENOSPC;
+    }
+
+    struct ext_node root;
+    struct wfs_extent split;
+    struct wfs_extent e = { .lblk = index, .len = 1, .start = off };
+    ext_root(inode, &root);
+
+    /*
+      Take the blocks for every split up front: one that failed half way
+      up the tree would leave the nodes already split off unreferenced,
+      and the file blocks they map with them.
+    */
+    size_t groups[root.hdr->depth + 1];
+    off_t reserved[root.hdr->depth + 1];
+    struct ext_spares spares = { reserved, 0 };
+    for (int level = ext_blocks_needed(&root, &e, groups) - 1; level >= 0; --level) {
+        if (!(reserved[spares.n] = alloc_meta_block(groups[level]))) {
+            while (spares.n) {
+                free_block(reserved[--spares.n]);
+            }
+            free_block(off);
+            return -ENOSPC;
+        }
+        spares.n++;
+    }
+
+    int err = ext_insert(&root, &e, 1, &split, &spares);
+    while (spares.n) {
+        free_block(reserved[--spares.n]);
+    }
+    if (err < 0) {
+        free_block(off);
+        return err;
+    }
+    return off;
+}
+
+/*
+  Map block `index` of a file to its disk offset. Returns 0 for an
+  unallocated block when `create` is not set, and a negative errno if the
+  block cannot be mapped or allocated.
+*/
+off_t bmap(struct wfs_inode *inode, off_t index, int create) {
+    if (sb->features & WFS_FEATURE_EXTENTS) {
+        return ext_bmap(inode, index, create);
+    }
+    return ptr_bmap(inode, index, create);
+}
+
+/*
+  Look up block `index` like bmap() without allocating, and store in *run
+  how many blocks from there on (at most `max`) sit back to back on disk,
+  so the caller can copy them in one go. A hole is returned as offset 0,
+  with *run covering every unmapped block that follows.
+*/
+off_t bmap_run(struct wfs_inode *inode, off_t index, off_t max, off_t *run) {
+    *run = 1;
+    if (sb->features & WFS_FEATURE_EXTENTS) {
+        size_t len;
+        off_t off = index < UINT_MAX ? ext_lookup(inode, index, &len) : 0;
+        if (off) {
+            *run = (off_t)len < max ? (off_t)len : max;
+        } else {
+            while (*run < max && index + *run < UINT_MAX && !ext_lookup(inode, index + *run, NULL)) {
+                ++*run;
+            }
+        }
+        return off;
+    }
+
+    off_t off = ptr_bmap(inode, index, 0);
+    if (off <= 0) {
+        while (*run < max && ptr_bmap(inode, index + *run, 0) <= 0) {
+            ++*run;
+        }
+        return 0;
+    }
+    while (*run < max && ptr_bmap(inode, index + *run, 0) == off + *run * block_size) {
+        ++*run;
+    }
+    return off;
+}
+
+// Release every data block past the first `keep` blocks of a file
+void free_blocks_from(struct wfs_inode *inode, off_t keep) {
+    if (inode->flags & WFS_INODE_INLINE) {
+        return; // blocks[] holds file data, not block numbers
+    }
+    if (sb->features & WFS_FEATURE_EXTENTS) {
+        struct ext_node root;
+        ext_root(inode, &root);
+        ext_trim(&root, keep < UINT_MAX ? keep : UINT_MAX);
+    } else {
+        ptr_trim(inode, keep);
+    }
+}
+
+// Map every hole among blocks [start, end) of a file, each placed after the one before where possible
+int preallocate(struct wfs_inode *inode, off_t start, off_t end) {
+    for (off_t index = start; index < end; ++index) {
+        off_t off = bmap(inode, index, 1);
+        if (off < 0) {
+            return off;
+        }
+    }
+    return 0;
+}
+
+// Free the blocks a file has past its end, unless fallocate() reserved them
+void trim_prealloc(struct wfs_inode *inode) {
+    if (!(inode->flags & (WFS_INODE_INLINE | WFS_INODE_PREALLOC))) {
+        free_blocks_from(inode, (inode->size + block_size - 1) / block_size);
+    }
+}
+
+void free_inode(struct wfs_inode *inode) {
+    free_blocks_from(inode, 0);
+    release_bit(&inode_map, inode->num);
+}
+
+// Bytes of file data that fit in an inode slot
+size_t inline_capacity(void) {
+    return sb->inode_size - INLINE_DATA_OFFSET;
+}
+
+char *inline_data(struct wfs_inode *inode) {
+    return (char *)inode + INLINE_DATA_OFFSET;
+}
+
+// Move an inline file's data out to its first data block so the file can grow past its slot
+int inline_to_blocks(struct wfs_inode *inode) {
+    char data[BLOCK_SIZE];
+    size_t len = inode->size;
+    memcpy(data, inline_data(inode), len);
+    memset(inline_data(inode), 0, inline_capacity()); // From now on blocks[] maps blocks again
+    inode->flags &= ~WFS_INODE_INLINE;
+
+    if (len > 0) {
+        off_t off = bmap(inode, 0, 1);
+        if (off < 0) {
+            memcpy(inline_data(inode), data, len);
+            inode->flags |= WFS_INODE_INLINE;
+            return off;
+        }
+        memcpy(data_at(off), data, len);
+        mirror_range(data_at(off), block_size);
+        csum_update(off);
+    }
+    mirror_range(inode, sb->inode_size);
+    return 0;
+}
+
+// Does this directory block hold part of the hash index rather than dentries?
+int is_index_block(const char *block) {
+    const struct wfs_dx_header *hdr = (const struct wfs_dx_header *)block;
+    return hdr->unused == 0 && hdr->magic == WFS_DX_MAGIC;
+}
+
+/*
+  Directory blocks. The functions below work on one block of entries in
+  either format, fixed wfs_dentry slots or wfs_dirent records, so the
+  rest of the directory code doesn't care which one the filesystem uses.
+  An entry is found by its byte position in the block, where its slot or
+  record starts.
+*/
+struct dir_entry {
+    size_t pos;         /* Where the entry starts in its block */
+    const char *name;   /* Not NUL-terminated */
+    size_t len;
+    int num;
+    unsigned char type; /* As in d_type; DT_UNKNOWN with fixed dentries, which don't store it */
+};
+
+// Most entries a block can hold, one-byte names assumed
+size_t dblk_capacity(void) {
+    return var_dentries ? block_size / DIRENT_LEN(1) : DENTRIES_PER_BLOCK;
+}
+
+/*
+  Find the first entry at or after position `pos`, which must be where a
+  slot or record starts, and move `pos` past it. Return 0 once the block
+  has no more. Index blocks hold no entries.
+*/
+int dblk_next(const char *block, size_t *pos, struct dir_entry *e) {
+    if (!var_dentries) {
+        if (is_index_block(block)) {
+            return 0;
+        }
+        for (; *pos < block_size; *pos += sizeof(struct wfs_dentry)) {
+            const struct wfs_dentry *d = (const struct wfs_dentry *)(block + *pos);
+            if (d->name[0]) {
+                *e = (struct dir_entry){ *pos, d->name, strnlen(d->name, MAX_NAME), d->num, DT_UNKNOWN };
+                *pos += sizeof(*d);
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    while (*pos < block_size) {
+        const struct wfs_dirent *d = (const struct wfs_dirent *)(block + *pos);
+        size_t len = d->rec_len * DIRENT_ALIGN;
+        if (len < DIRENT_LEN(d->name_len) || *pos + len > block_size) {
+            return 0; // A broken chain ends the block
+        }
+        size_t start = *pos;
+        *pos += len;
+        if (d->name_len) {
+            *e = (struct dir_entry){ start, d->name, d->name_len, d->num, d->type };
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int dblk_find(const char *block, const char *name, size_t len, struct dir_entry *e) {
+    for (size_t pos = 0; dblk_next(block, &pos, e);) {
+        if (e->len == len && memcmp(e->name, name, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Add an entry to a block, or return -ENOSPC if it has no room for it
+int dblk_insert(char *block, const char *name, size_t len, int num, unsigned char type) {
+    if (!var_dentries) {
+        for (size_t pos = 0; pos < block_size; pos += sizeof(struct wfs_dentry)) {
+            struct wfs_dentry *d = (struct wfs_dentry *)(block + pos);
+            if (!d->name[0]) {
+                memset(d->name, 0, MAX_NAME);
+                memcpy(d->name, name, len);
+                d->num = num;
+                mirror_range(d, sizeof(*d));
+                return 0;
+            }
+        }
+        return -ENOSPC;
+    }
+
+    // Take a free record, or split the room to spare off the end of a live one
+    size_t need = DIRENT_LEN(len);
+    for (size_t pos = 0; pos < block_size;) {
+        struct wfs_dirent *d = (struct wfs_dirent *)(block + pos);
+        size_t rec = d->rec_len * DIRENT_ALIGN;
+        size_t used = d->name_len ? DIRENT_LEN(d->name_len) : 0;
+        if (rec < used || rec == 0 || pos + rec > block_size) {
+            break;
+        }
+        if (rec - used >= need) {
+            struct wfs_dirent *fresh = (struct wfs_dirent *)(block + pos + used);
+            if (used) {
+                d->rec_len = used / DIRENT_ALIGN;
+                fresh->rec_len = (rec - used) / DIRENT_ALIGN;
+            }
+            fresh->num = num;
+            fresh->name_len = len;
+            fresh->type = type;
+            memcpy(fresh->name, name, len);
+            mirror_range(d, used + need);
+            return 0;
+        }
+        pos += rec;
+    }
+    return -ENOSPC;
+}
+
+// Remove the entry at `pos`. Live records never move, which keeps readdir offsets valid.
+void dblk_remove(char *block, size_t pos) {
+    if (!var_dentries) {
+        memset(block + pos, 0, sizeof(struct wfs_dentry));
+        mirror_range(block + pos, sizeof(struct wfs_dentry));
+        return;
+    }
+
+    struct wfs_dirent *d = (struct wfs_dirent *)(block + pos);
+    if (pos == 0) {
+        d->num = 0;
+        d->name_len = 0;
+        mirror_range(d, sizeof(*d));
+        return;
+    }
+    struct wfs_dirent *prev = (struct wfs_dirent *)block;
+    while ((char *)prev + prev->rec_len * DIRENT_ALIGN < (char *)d && prev->rec_len) {
+        prev = (struct wfs_dirent *)((char *)prev + prev->rec_len * DIRENT_ALIGN);
+    }
+    prev->rec_len += d->rec_len;
+    mirror_range(prev, sizeof(*prev));
+}
+
+// Lay out a freshly zeroed block as an empty one
+void dblk_init(char *block) {
+    if (var_dentries) {
+        struct wfs_dirent *d = (struct wfs_dirent *)block;
+        d->rec_len = block_size / DIRENT_ALIGN;
+        mirror_range(d, sizeof(*d));
+    }
+}
+
+// Return block `lblk` of a directory, or NULL past its end
+char *dir_block(struct wfs_inode *dir, off_t lblk) {
+    if (lblk >= dir->size / (off_t)block_size) {
+        return NULL;
+    }
+    off_t off = bmap(dir, lblk, 0);
+    return off > 0 ? block_at(off) : NULL;
+}
+
+/*
+  Hashed directories (WFS_FEATURE_DIR_INDEX). A directory starts as one
+  plain block of dentries. When that fills up, block 0 becomes the root
+  of a hash index and the dentries move to a leaf block. Index entries map
+  name hashes to leaf blocks: a leaf holds every name whose hash is at or
+  above its entry's hash and below the next entry's. A full leaf splits
+  at its median hash. The root can grow one level of index blocks below
+  it, so a lookup reads at most three blocks however big the directory.
+*/
+#define DX_MAX_LEVELS (2)
+
+unsigned int dx_hash(const char *name, size_t len) {
+    unsigned int h = 2166136261U; // FNV-1a
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char)name[i]) * 16777619U;
+    }
+    return h;
+}
+
+struct wfs_dx_header *dx_node(struct wfs_inode *dir, unsigned int lblk) {
+    off_t off = bmap(dir, lblk, 0);
+    return off > 0 ? (struct wfs_dx_header *)block_at(off) : NULL;
+}
+
+struct wfs_dx_entry *dx_entries(struct wfs_dx_header *node) {
+    return (struct wfs_dx_entry *)(node + 1);
+}
+
+struct wfs_dx_header *dx_root(struct wfs_inode *dir) {
+    if (!(sb->features & WFS_FEATURE_DIR_INDEX) || dir->size == 0) {
+        return NULL;
+    }
+    if (var_dentries) {
+        return (dir->flags & WFS_INODE_INDEX) ? dx_node(dir, 0) : NULL;
+    }
+    struct wfs_dx_header *root = dx_node(dir, 0);
+    return root && is_index_block((char *)root) ? root : NULL;
+}
+
+// The index nodes passed on the way from the root to the leaf for a hash
+struct dx_path {
+    struct wfs_dx_header *node[DX_MAX_LEVELS];
+    int pos[DX_MAX_LEVELS];
+    int depth;
+};
+
+// Walk the index down to the leaf block covering `hash`
+unsigned int dx_walk(struct wfs_inode *dir, struct wfs_dx_header *root, unsigned int hash, struct dx_path *path) {
+    struct wfs_dx_header *node = root;
+    path->depth = 0;
+
+    for (;;) {
+        struct wfs_dx_entry *e = dx_entries(node);
+        int pos = 0;
+        while (pos + 1 < node->count && e[pos + 1].hash <= hash) {
+            ++pos;
+        }
+        path->node[path->depth] = node;
+        path->pos[path->depth] = pos;
+        path->depth++;
+
+        if (path->depth > root->levels) {
+            return e[pos].block;
+        }
+        node = dx_node(dir, e[pos].block);
+    }
+}
+
+// Append a fresh empty block to a directory and return its logical number
+long dir_grow(struct wfs_inode *dir) {
+    unsigned int lblk = dir->size / block_size;
+    off_t off = bmap(dir, lblk, 1);
+    if (off < 0) {
+        return off;
+    }
+    init_meta_block(off);
+    dblk_init(block_at(off));
+    dir->size += block_size;
+    mirror_range(dir, sizeof(*dir));
+    return lblk;
+}
+
+void dx_init_node(struct wfs_dx_header *node, int levels) {
+    memset(node, 0, block_size);
+    node->levels = levels;
+    node->magic = WFS_DX_MAGIC;
+    if (var_dentries) {
+        node->rec_len = block_size / DIRENT_ALIGN;
+    }
+}
+
+void dx_put(struct wfs_dx_header *node, int pos, unsigned int hash, unsigned int block) {
+    struct wfs_dx_entry *e = dx_entries(node);
+    memmove(&e[pos + 1], &e[pos], (node->count - pos) * sizeof(*e));
+    e[pos] = (struct wfs_dx_entry){ hash, block };
+    node->count++;
+    mirror_range(node, block_size);
+}
+
+// Link a new leaf into the index right after the entry `path` went through
+int dx_link(struct wfs_inode *dir, struct dx_path *path, unsigned int hash, unsigned int leaf) {
+    int level = path->depth - 1;
+    struct wfs_dx_header *node = path->node[level];
+    int pos = path->pos[level] + 1;
+
+    if (node->count < DX_ENTRIES_PER_BLOCK(block_size)) {
+        dx_put(node, pos, hash, leaf);
+        return 0;
+    }
+
+    struct wfs_dx_header *root = path->node[0];
+    if (level == 0 ? root->levels + 1 >= DX_MAX_LEVELS : root->count >= DX_ENTRIES_PER_BLOCK(block_size)) {
+        return -ENOSPC;
+    }
+    long lblk = dir_grow(dir);
+    if (lblk < 0) {
+        return lblk;
+    }
+    struct wfs_dx_header *fresh = dx_node(dir, lblk);
+
+    if (level == 0) {
+        // The root is full: move its entries into a new index block one
+        // level down, then split that block like any other full one
+        dx_init_node(fresh, 0);
+        memcpy(dx_entries(fresh), dx_entries(root), root->count * sizeof(struct wfs_dx_entry));
+        fresh->count = root->count;
+        mirror_range(fresh, block_size);
+
+        root->levels++;
+        root->count = 0;
+        dx_put(root, 0, 0, lblk);
+
+        struct dx_path lower = { .node = { root, fresh }, .pos = { 0, path->pos[0] }, .depth = 2 };
+        return dx_link(dir, &lower, hash, leaf);
+    }
+
+    // Split a full lower index block in half and link the upper half into the root
+    int half = node->count / 2;
+    dx_init_node(fresh, 0);
+    memcpy(dx_entries(fresh), &dx_entries(node)[half], (node->count - half) * sizeof(struct wfs_dx_entry));
+    fresh->count = node->count - half;
+    node->count = half;
+    mirror_range(node, block_size);
+    if (pos <= half) {
+        dx_put(node, pos, hash, leaf);
+    } else {
+        dx_put(fresh, pos - half, hash, leaf);
+    }
+    dx_put(root, path->pos[0] + 1, dx_entries(fresh)[0].hash, lblk);
+    return 0;
+}
+
+// Move the upper half of a full leaf, by hash, into a new leaf
+int dx_split_leaf(struct wfs_inode *dir, struct dx_path *path, char *leaf) {
+    unsigned int sorted[dblk_capacity()];
+    struct dir_entry e;
+    size_t n = 0;
+    for (size_t pos = 0; dblk_next(leaf, &pos, &e);) {
+        sorted[n++] = dx_hash(e.name, e.len);
+    }
+    if (n < 2) {
+        return -ENOSPC;
+    }
+    for (size_t i = 1; i < n; ++i) {
+        for (size_t j = i; j > 0 && sorted[j - 1] > sorted[j]; --j) {
+            unsigned int t = sorted[j];
+            sorted[j] = sorted[j - 1];
+            sorted[j - 1] = t;
+        }
+    }
+
+    // Split at the median, moving off runs of equal hashes, which must stay together
+    size_t mid = n / 2;
+    while (mid < n && sorted[mid] == sorted[mid - 1]) {
+        ++mid;
+    }
+    if (mid == n) {
+        for (mid = n / 2; mid > 0 && sorted[mid] == sorted[mid - 1]; --mid) {
+        }
+        if (mid == 0) {
+            return -ENOSPC;
+        }
+    }
+    unsigned int split = sorted[mid];
+
+    long lblk = dir_grow(dir);
+    if (lblk < 0) {
+        return lblk;
+    }
+    // Link the new leaf in while it is still empty, so a full index leaves every name where lookups look
+    int err = dx_link(dir, path, split, lblk);
+    if (err < 0) {
+        return err;
+    }
+    char *upper = (char *)dx_node(dir, lblk);
+    for (size_t pos = 0; dblk_next(leaf, &pos, &e);) {
+        if (dx_hash(e.name, e.len) >= split) {
+            if ((err = dblk_insert(upper, e.name, e.len, e.num, e.type)) < 0) {
+                return err;
+            }
+            dblk_remove(leaf, e.pos);
+        }
+    }
+    return 0;
+}
+
+// Turn a directory's single full block into an index root over one leaf
+int dx_convert(struct wfs_inode *dir) {
+    long lblk = dir_grow(dir);
+    if (lblk < 0) {
+        return lblk;
+    }
+    struct wfs_dx_header *root = dx_node(dir, 0);
+    char *leaf = (char *)dx_node(dir, lblk);
+    memcpy(leaf, root, block_size);
+    mirror_range(leaf, block_size);
+
+    dx_init_node(root, 0);
+    dx_put(root, 0, 0, lblk);
+    if (var_dentries) {
+        dir->flags |= WFS_INODE_INDEX;
+        mirror_range(dir, sizeof(*dir));
+    }
+    return 0;
+}
+
+int dx_find(struct wfs_inode *dir, struct wfs_dx_header *root, const char *name, size_t len, char **block, struct dir_entry *e) {
+    struct dx_path path;
+    *block = (char *)dx_node(dir, dx_walk(dir, root, dx_hash(name, len), &path));
+    return *block && dblk_find(*block, name, len, e);
+}
+
+// Add a name to the leaf its hash belongs in, splitting leaves as often as needed
+int dx_insert(struct wfs_inode *dir, struct wfs_dx_header *root, const char *name, size_t len, int num, unsigned char type) {
+    for (;;) {
+        struct dx_path path;
+        char *leaf = (char *)dx_node(dir, dx_walk(dir, root, dx_hash(name, len), &path));
+        int err = dblk_insert(leaf, name, len, num, type);
+        if (err != -ENOSPC) {
+            return err;
+        }
+        if ((err = dx_split_leaf(dir, &path, leaf)) < 0) {
+            return err;
+        }
+    }
+}
+
+// Find `name` in a directory, also returning the block that holds it
+int dir_find(struct wfs_inode *dir, const char *name, char **block, struct dir_entry *e) {
+    size_t len = strlen(name);
+    struct wfs_dx_header *root = dx_root(dir);
+    if (root) {
+        return dx_find(dir, root, name, len, block, e);
+    }
+
+    for (off_t lblk = 0; (*block = dir_block(dir, lblk)); ++lblk) {
+        if (dblk_find(*block, name, len, e)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int dir_lookup(struct wfs_inode *dir, const char *name) {
+    char *block;
+    struct dir_entry e;
+    return dir_find(dir, name, &block, &e) ? e.num : -ENOENT;
+}
+
+// dir_lookup() through the dentry cache, remembering misses as well as hits
+int lookup_child(struct wfs_inode *dir, const char *name) {
+    int num;
+    if (!dcache_lookup(dir->num, name, &num)) {
+        num = dir_lookup(dir, name);
+        dcache_insert(dir->num, name, num);
+    }
+    return num;
+}
+
+int dir_add(struct wfs_inode *dir, const char *name, int num) {
+    size_t len = strlen(name);
+    unsigned char type = IFTODT(inode_at(num)->mode);
+    struct wfs_dx_header *root = dx_root(dir);
+    char *block;
+    int err = -ENOSPC;
+
+    if (!root) {
+        for (off_t lblk = 0; err == -ENOSPC && (block = dir_block(dir, lblk)); ++lblk) {
+            err = dblk_insert(block, name, len, num, type);
+        }
+        if (err == -ENOSPC && (sb->features & WFS_FEATURE_DIR_INDEX) && dir->size == block_size) {
+            // The first block is full: index the directory from here on
+            if ((err = dx_convert(dir)) < 0) {
+                return err;
+            }
+            root = dx_root(dir);
+        }
+    }
+
+    if (root) {
+        err = dx_insert(dir, root, name, len, num, type);
+    } else if (err == -ENOSPC) {
+        // No room left, so grow the directory by one block
+        long lblk = dir_grow(dir);
+        if (lblk < 0) {
+            return lblk;
+        }
+        err = dblk_insert(dir_block(dir, lblk), name, len, num, type);
+    }
+    if (err < 0) {
+        return err;
+    }
+    dcache_insert(dir->num, name, num);
+
+    dir->mtim = dir->ctim = time(NULL);
+    mirror_range(dir, sizeof(*dir));
+    return 0;
+}
+
+void dir_remove(struct wfs_inode *dir, const char *name) {
+    char *block;
+    struct dir_entry e;
+    if (dir_find(dir, name, &block, &e)) {
+        dblk_remove(block, e.pos);
+    }
+    dcache_insert(dir->num, name, -ENOENT);
+    dir->mtim = dir->ctim = time(NULL);
+    mirror_range(dir, sizeof(*dir));
+}
+
+int dir_is_empty(struct wfs_inode *dir) {
+    char *block;
+    struct dir_entry e;
+    for (off_t lblk = 0; (block = dir_block(dir, lblk)); ++lblk) {
+        size_t pos = 0;
+        if (dblk_next(block, &pos, &e)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Walk `path` from the root inode
+int walk_path(const char *path, struct wfs_inode **out) {
+    struct wfs_inode *inode = inode_at(0);
+    char name[DIRENT_NAME_MAX + 1];
+
+    while (*path) {
+        while (*path == '/') {
+            ++path;
+        }
+        if (!*path) {
+            break;
+        }
+
+        size_t len = strcspn(path, "/");
+        if (len > name_max) {
+            return -ENAMETOOLONG;
+        }
+        if (!S_ISDIR(inode->mode)) {
+            return -ENOTDIR;
+        }
+        memcpy(name, path, len);
+        name[len] = '\0';
+        path += len;
+
+        int num = lookup_child(inode, name);
+        if (num < 0) {
+            return num;
+        }
+        inode = inode_at(num);
+    }
+
+    *out = inode;
+    return 0;
+}
+
+// Resolve `path` to its inode
+int lookup_path(const char *path, struct wfs_inode **out) {
+    unsigned long start = now_ns();
+    int err = walk_path(path, out);
+    stats_end(ST_LOOKUP, start);
+    return err;
+}
+
+// Resolve the parent directory of `path` and copy out its final component
+int lookup_parent(const char *path, struct wfs_inode **parent, char *name) {
+    const char *slash = strrchr(path, '/');
+    const char *base = slash ? slash + 1 : path;
+    if (strlen(base) > name_max) {
+        return -ENAMETOOLONG;
+    }
+    if (!*base) {
+        return -EINVAL;
+    }
+    strcpy(name, base);
+
+    char *dirpath = strndup(path, base - path);
+    if (!dirpath) {
+        return -ENOMEM;
+    }
+    int err = lookup_path(dirpath, parent);
+    free(dirpath);
+    if (err < 0) {
+        return err;
+    }
+    return S_ISDIR((*parent)->mode) ? 0 : -ENOTDIR;
+}
+
+int create_node(const char *path, mode_t mode) {
+    struct wfs_inode *parent;
+    char name[DIRENT_NAME_MAX + 1];
+    if (is_stats_path(path)) {
+        return -EEXIST;
+    }
+    int err = lookup_parent(path, &parent, name);
+    if (err < 0) {
+        return err;
+    }
+    if (lookup_child(parent, name) >= 0) {
+        return -EEXIST;
+    }
+
+    struct wfs_inode *inode = alloc_inode(mode, parent);
+    if (!inode) {
+        return -ENOSPC;
+    }
+    if ((err = dir_add(parent, name, inode->num)) < 0) {
+        free_inode(inode);
+        return err;
+    }
+    if (S_ISDIR(mode)) {
+        parent->nlinks++;
+        mirror_range(parent, sizeof(*parent));
+    }
+    return 0;
+}
+
+int remove_node(const char *path, int is_dir) {
+    struct wfs_inode *parent, *inode;
+    char name[DIRENT_NAME_MAX + 1];
+    if (is_stats_path(path)) {
+        return -EPERM;
+    }
+    int err = lookup_parent(path, &parent, name);
+    if (err < 0) {
+        return err;
+    }
+    int num = lookup_child(parent, name);
+    if (num < 0) {
+        return num;
+    }
+    inode = inode_at(num);
+
+    if (is_dir) {
+        if (!S_ISDIR(inode->mode)) {
+            return -ENOTDIR;
+        }
+        if (!dir_is_empty(inode)) {
+            return -ENOTEMPTY;
+        }
+        parent->nlinks--;
+    } else if (S_ISDIR(inode->mode)) {
+        return -EISDIR;
+    }
+
+    dir_remove(parent, name);
+    free_inode(inode);
+    return 0;
+}
+
+int rename_node(const char *from, const char *to) {
+    struct wfs_inode *src_dir, *dst_dir;
+    char src_name[DIRENT_NAME_MAX + 1], dst_name[DIRENT_NAME_MAX + 1];
+    int err;
+
+    if (is_stats_path(from) || is_stats_path(to)) {
+        return -EPERM;
+    }
+    if ((err = lookup_parent(from, &src_dir, src_name)) < 0 ||
+        (err = lookup_parent(to, &dst_dir, dst_name)) < 0) {
+        return err;
+    }
+    int num = lookup_child(src_dir, src_name);
+    if (num < 0) {
+        return num;
+    }
+    struct wfs_inode *inode = inode_at(num);
+
+    // A directory can't move below itself
+    size_t len = strlen(from);
+    if (S_ISDIR(inode->mode) && strncmp(to, from, len) == 0 && to[len] == '/') {
+        return -EINVAL;
+    }
+
+    int existing = lookup_child(dst_dir, dst_name);
+    if (existing == num) {
+        return 0;
+    }
+    if (existing >= 0) {
+        struct wfs_inode *target = inode_at(existing);
+        if (S_ISDIR(target->mode)) {
+            if (!S_ISDIR(inode->mode)) {
+                return -EISDIR;
+            }
+            if (!dir_is_empty(target)) {
+                return -ENOTEMPTY;
+            }
+            dst_dir->nlinks--;
+        } else if (S_ISDIR(inode->mode)) {
+            return -ENOTDIR;
+        }
+        dir_remove(dst_dir, dst_name);
+        free_inode(target);
+    }
+
+    if ((err = dir_add(dst_dir, dst_name, num)) < 0) {
+        return err;
+    }
+    dir_remove(src_dir, src_name);
+    if (S_ISDIR(inode->mode) && src_dir != dst_dir) {
+        src_dir->nlinks--;
+        dst_dir->nlinks++;
+        mirror_range(src_dir, sizeof(*src_dir));
+        mirror_range(dst_dir, sizeof(*dst_dir));
+    }
+    inode->ctim = time(NULL);
+    mirror_range(inode, sizeof(*inode));
+    return 0;
+}
+
+// Largest number of blocks a file can map
+off_t max_file_blocks(void) {
+    if (sb->features & WFS_FEATURE_EXTENTS) {
+        return UINT_MAX;
+    }
+    return IND_BLOCK + PTRS_PER_BLOCK;
+}
+
+int set_size(struct wfs_inode *inode, off_t size) {
+    off_t nblocks = (size + block_size - 1) / block_size;
+    if (inode->flags & WFS_INODE_INLINE) {
+        if (size <= (off_t)inline_capacity()) {
+            if (size < inode->size) {
+                memset(inline_data(inode) + size, 0, inode->size - size);
+            }
+            inode->size = size;
+            inode->mtim = inode->ctim = time(NULL);
+            mirror_range(inode, sb->inode_size);
+            return 0;
+        }
+        int err = inline_to_blocks(inode);
+        if (err < 0) {
+            return err;
+        }
+    }
+    if (size < inode->size) {
+        free_blocks_from(inode, nblocks);
+        inode->flags &= ~WFS_INODE_PREALLOC;
+        // Clear the tail of the last block so a later extension reads zeros
+        if (size % block_size) {
+            off_t off = bmap(inode, size / block_size, 0);
+            if (off > 0) {
+                size_t from = size % block_size;
+                // Reads and the next write-back both use a cached copy, so clear that one
+                pthread_mutex_lock(&cache_lock);
+                struct cache_block *cb = cache_find(off);
+                if (cb) {
+                    memset(cb->data + from, 0, block_size - from);
+                    cb->dirty = 1;
+                }
+                pthread_mutex_unlock(&cache_lock);
+                if (!cb) {
+                    memset(data_at(off) + from, 0, block_size - from);
+                    mirror_range(data_at(off), block_size);
+                    csum_update(off);
+                }
+            }
+        }
+    } else if (nblocks > max_file_blocks()) {
+        return -EFBIG;
+    }
+    // Growing leaves a hole: blocks past the old end are allocated when first written
+    inode->size = size;
+    inode->mtim = inode->ctim = time(NULL);
+    mirror_range(inode, sizeof(*inode));
+    return 0;
+}
+
+/*
+  Commit all metadata changed so far. File data goes out first, so the
+  committed metadata never points at blocks whose contents exist only in
+  memory. Blocks freed since the last commit are released here, as part
+  of the same transaction. The caller of commit_locked() holds
+  journal_lock for writing.
+*/
+int commit_locked(void) {
+    unsigned long start = now_ns();
+    cache_flush();
+    long page = sysconf(_SC_PAGESIZE);
+    off_t data = sb->d_blocks_ptr / page * page;
+    for (int i = 0; i < num_disks; ++i) {
+        msync(disks[i].map + data, disks[i].size - data, MS_SYNC);
+    }
+
+    pthread_mutex_lock(&free_lock);
+    for (size_t i = 0; i < num_pending; ++i) {
+        release_bit(&data_map, (pending_frees[i] - sb->d_blocks_ptr) / block_size);
+    }
+    num_pending = 0;
+    pthread_mutex_unlock(&free_lock);
+
+    int err = journal_commit();
+    stats_end(ST_COMMIT, start);
+    return err;
+}
+
+int commit_metadata(void) {
+    pthread_rwlock_wrlock(&journal_lock);
+    int err = commit_locked();
+    pthread_rwlock_unlock(&journal_lock);
+    return err;
+}
+
+// Bracket an operation that changes metadata
+void begin_update(void) {
+    if (journaled) {
+        pthread_rwlock_rdlock(&journal_lock);
+    }
+}
+
+void end_update(void) {
+    if (journaled) {
+        pthread_rwlock_unlock(&journal_lock);
+        if (journal_full()) {
+            commit_metadata();
+        }
+    }
+}
+
+void fill_stat(struct wfs_inode *inode, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_ino = inode->num;
+    stbuf->st_mode = inode->mode;
+    stbuf->st_nlink = inode->nlinks;
+    stbuf->st_uid = inode->uid;
+    stbuf->st_gid = inode->gid;
+    stbuf->st_size = inode->size;
+    stbuf->st_blksize = block_size;
+    stbuf->st_atime = inode->atim;
+    stbuf->st_mtime = inode->mtim;
+    stbuf->st_ctime = inode->ctim;
+}
+
+int wfs_getattr(const char *path, struct stat *stbuf) {
+    struct wfs_inode *inode;
+    if (is_stats_path(path)) {
+        char *text;
+        long len = stats_format(&text);
+        if (len < 0) {
+            return len;
+        }
+        free(text);
+        memset(stbuf, 0, sizeof(*stbuf));
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+        stbuf->st_size = len;
+        stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+        return 0;
+    }
+
+    unsigned long start = now_ns();
+    pthread_rwlock_rdlock(&tree_lock);
+    int err = lookup_path(path, &inode);
+    if (err == 0) {
+        pthread_rwlock_rdlock(inode_lock(inode));
+        fill_stat(inode, stbuf);
+        pthread_rwlock_unlock(inode_lock(inode));
+    }
+    pthread_rwlock_unlock(&tree_lock);
+    stats_end(ST_GETATTR, start);
+    return err;
+}
+
+int wfs_mknod(const char *path, mode_t mode, dev_t dev) {
+    (void)dev;
+    begin_update();
+    pthread_rwlock_wrlock(&tree_lock);
+    int err = create_node(path, mode);
+    pthread_rwlock_unlock(&tree_lock);
+    end_update();
+    return err;
+}
+
+int wfs_mkdir(const char *path, mode_t mode) {
+    begin_update();
+    pthread_rwlock_wrlock(&tree_lock);
+    int err = create_node(path, mode | S_IFDIR);
+    pthread_rwlock_unlock(&tree_lock);
+    end_update();
+    return err;
+}
+
+int wfs_unlink(const char *path) {
+    begin_update();
+    pthread_rwlock_wrlock(&tree_lock);
+    int err = remove_node(path, 0);
+    pthread_rwlock_unlock(&tree_lock);
+    end_update();
+    return err;
+}
+
+int wfs_rmdir(const char *path) {
+    begin_update();
+    pthread_rwlock_wrlock(&tree_lock);
+    int err = remove_node(path, 1);
+    pthread_rwlock_unlock(&tree_lock);
+    end_update();
+    return err;
+}
+
+/*
+  Start readahead for `len` bytes of a file from `offset` by asking the
+  kernel to page in the mapped runs behind them.
+*/
+void readahead_range(struct wfs_inode *inode, off_t offset, size_t len) {
+    long page = sysconf(_SC_PAGESIZE);
+    off_t index = offset / block_size;
+    off_t end = (offset + len + block_size - 1) / block_size;
+
+    while (index < end) {
+        off_t run;
+        off_t off = bmap_run(inode, index, end - index, &run);
+        size_t left = run * block_size;
+        while (off > 0 && left > 0) {
+            size_t piece = left;
+            off_t disk_off;
+            int disk = locate(off, &piece, &disk_off);
+            off_t start = disk_off / page * page;
+            madvise(disks[disk].map + start, disk_off + piece - start, MADV_WILLNEED);
+            off += piece;
+            left -= piece;
+        }
+        index += run;
+    }
+}
+
+int wfs_rename(const char *from, const char *to) {
+    begin_update();
+    pthread_rwlock_wrlock(&tree_lock);
+    int err = rename_node(from, to);
+    pthread_rwlock_unlock(&tree_lock);
+    end_update();
+    return err;
+}
+
+int read_file(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct wfs_inode *inode;
+    pthread_rwlock_rdlock(&tree_lock);
+    int err = lookup_path(path, &inode);
+    if (err == 0 && S_ISDIR(inode->mode)) {
+        err = -EISDIR;
+    }
+    if (err < 0) {
+        pthread_rwlock_unlock(&tree_lock);
+        return err;
+    }
+    pthread_rwlock_rdlock(inode_lock(inode));
+
+    if (offset >= inode->size) {
+        size = 0;
+    } else if (offset + (off_t)size > inode->size) {
+        size = inode->size - offset;
+    }
+
+    if (inode->flags & WFS_INODE_INLINE) {
+        // The data came in with the inode, so there is nothing more to fetch
+        if (size > 0) {
+            memcpy(buf, inline_data(inode) + offset, size);
+        }
+        pthread_rwlock_unlock(inode_lock(inode));
+        pthread_rwlock_unlock(&tree_lock);
+        return size;
+    }
+
+    // Copy whole runs of physically contiguous blocks at a time
+    struct io_batch batch;
+    batch_init(&batch, 0);
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        size_t skip = pos % block_size;
+        off_t run;
+        off_t off = bmap_run(inode, pos / block_size, (skip + size - done + block_size - 1) / block_size, &run);
+
+        size_t chunk = run * block_size - skip;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+        if (off > 0 && cache_capacity) {
+            // Blocks with a cached copy are served from the cache, the rest from disk
+            pthread_mutex_lock(&cache_lock);
+            for (size_t part = 0; part < chunk && err == 0; ) {
+                off_t block = off + (skip + part) / block_size * block_size;
+                size_t in = (skip + part) % block_size;
+                size_t n = block_size - in < chunk - part ? block_size - in : chunk - part;
+                struct cache_block *cb = cache_find(block);
+                stat_add(cb ? &cache_stats.hits : &cache_stats.misses, 1);
+                if (cb) {
+                    memcpy(buf + done + part, cb->data + in, n);
+                } else {
+                    err = batch_add_read(&batch, block + in, buf + done + part, n);
+                }
+                part += n;
+            }
+            pthread_mutex_unlock(&cache_lock);
+            if (err < 0) {
+                break;
+            }
+        } else if (off > 0) {
+            if ((err = batch_add_read(&batch, off + skip, buf + done, chunk)) < 0) {
+                break;
+            }
+        } else {
+            memset(buf + done, 0, chunk);
+        }
+        done += chunk;
+    }
+    if (err < 0) {
+        batch_free(&batch);
+        pthread_rwlock_unlock(inode_lock(inode));
+        pthread_rwlock_unlock(&tree_lock);
+        return err;
+    }
+    err = batch_run(&batch);
+    batch_free(&batch);
+    if (err < 0) {
+        pthread_rwlock_unlock(inode_lock(inode));
+        pthread_rwlock_unlock(&tree_lock);
+        return err;
+    }
+
+    /*
+      A reader that keeps going where it left off gets a doubling readahead
+      window. Reads through one handle may race; the state is only a hint,
+      so it is read and written with relaxed atomics and no lock.
+    */
+    struct wfs_file *file = (struct wfs_file *)(uintptr_t)fi->fh;
+    if (file && done) {
+        size_t window = 0;
+        if (offset == __atomic_load_n(&file->next, __ATOMIC_RELAXED)) {
+            window = __atomic_load_n(&file->ra_window, __ATOMIC_RELAXED);
+            window = window ? window * 2 : RA_MIN;
+            if (window > RA_MAX) {
+                window = RA_MAX;
+            }
+            if (offset + (off_t)done < inode->size) {
+                readahead_range(inode, offset + done, window);
+            }
+        }
+        __atomic_store_n(&file->ra_window, window, __ATOMIC_RELAXED);
+        __atomic_store_n(&file->next, offset + done, __ATOMIC_RELAXED);
+    }
+
+    pthread_rwlock_unlock(inode_lock(inode));
+    pthread_rwlock_unlock(&tree_lock);
+    return done;
+}
+
+/*
+  Speculative preallocation. When a write through `file` appends to the
+  file and needs a new block, reserve blocks ahead of it as well, as many
+  as the file already has up to the prealloc limit, so a file that keeps
+  growing is laid out in long runs even while other files are written at
+  the same time. What is left unused past the end goes when the handle is
+  released.
+*/
+void speculate(struct wfs_inode *inode, struct wfs_file *file, off_t first, off_t last) {
+    off_t limit = options.prealloc_kb * 1024 / block_size;
+    if (!file || !limit || (inode->flags & WFS_INODE_PREALLOC) || bmap(inode, last, 0) != 0) {
+        return;
+    }
+    off_t ahead = last + 1 < limit ? last + 1 : limit;
+    off_t end = last + 1 + ahead;
+    if (end > max_file_blocks()) {
+        end = max_file_blocks();
+    }
+    // Running out of space here is not an error; the write itself finds out if it matters
+    preallocate(inode, first, end);
+    file->speculated = 1;
+}
+
+int write_file(const char *path, const char *buf, size_t size, off_t offset, struct wfs_file *file) {
+    struct wfs_inode *inode;
+    begin_update();
+    pthread_rwlock_rdlock(&tree_lock);
+    int err = lookup_path(path, &inode);
+    if (err == 0 && S_ISDIR(inode->mode)) {
+        err = -EISDIR;
+    }
+    if (err < 0) {
+        pthread_rwlock_unlock(&tree_lock);
+        end_update();
+        return err;
+    }
+    pthread_rwlock_wrlock(inode_lock(inode));
+    int append = offset == inode->size;
+
+    // Writing past the end leaves a hole between the old end and `offset`
+    if (offset > inode->size && (err = set_size(inode, offset)) < 0) {
+        pthread_rwlock_unlock(inode_lock(inode));
+        pthread_rwlock_unlock(&tree_lock);
+        end_update();
+        return err;
+    }
+
+    // A tiny file stays in its inode for as long as it fits
+    if (inode->flags & WFS_INODE_INLINE) {
+        if (offset + (off_t)size <= (off_t)inline_capacity()) {
+            memcpy(inline_data(inode) + offset, buf, size);
+            if (offset + (off_t)size > inode->size) {
+                inode->size = offset + size;
+            }
+            inode->mtim = inode->ctim = time(NULL);
+            mirror_range(inode, sb->inode_size);
+            pthread_rwlock_unlock(inode_lock(inode));
+            pthread_rwlock_unlock(&tree_lock);
+            end_update();
+            return size;
+        }
+        if ((err = inline_to_blocks(inode)) < 0) {
+            pthread_rwlock_unlock(inode_lock(inode));
+            pthread_rwlock_unlock(&tree_lock);
+            end_update();
+            return err;
+        }
+    }
+
+    if (append && size) {
+        speculate(inode, file, offset / block_size, (offset + size - 1) / block_size);
+    }
+
+    struct io_batch batch;
+    batch_init(&batch, 1);
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        size_t chunk = block_size - pos % block_size;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+        off_t off = bmap(inode, pos / block_size, 1);
+        if (off < 0) {
+            err = off;
+            break;
+        }
+        if (chunk < block_size) {
+            csum_heal(off); // The rest of the block is kept, so start from a good copy of it
+        }
+        if (cache_capacity) {
+            pthread_mutex_lock(&cache_lock);
+            struct cache_block *cb = cache_get(off, chunk == block_size);
+            memcpy(cb->data + pos % block_size, buf + done, chunk);
+            cb->dirty = 1;
+            pthread_mutex_unlock(&cache_lock);
+        } else if ((err = batch_add_data(&batch, off + pos % block_size, (char *)buf + done, chunk)) < 0) {
+            break;
+        }
+        done += chunk;
+    }
+    int ret = batch_run(&batch);
+    if (ret < 0) {
+        err = ret;
+        done = 0; // Which pieces made it is unknown
+    }
+    batch_free(&batch);
+    if (checksums && !cache_capacity) {
+        // Cached blocks get theirs when they are written back
+        for (off_t index = offset / block_size; index * (off_t)block_size < offset + (off_t)done; ++index) {
+            csum_update(bmap(inode, index, 0));
+        }
+    }
+
+    if (offset + (off_t)done > inode->size) {
+        inode->size = offset + done;
+    }
+    inode->mtim = inode->ctim = time(NULL);
+    mirror_range(inode, sizeof(*inode));
+
+    pthread_rwlock_unlock(inode_lock(inode));
+    pthread_rwlock_unlock(&tree_lock);
+    end_update();
+    return done ? (int)done : err;
+}
+
+int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct wfs_file *file = (struct wfs_file *)(uintptr_t)fi->fh;
+    if (file && file->stats) {
+        if (offset >= (off_t)file->stats_len) {
+            return 0;
+        }
+        if (size > file->stats_len - offset) {
+            size = file->stats_len - offset;
+        }
+        memcpy(buf, file->stats + offset, size);
+        return size;
+    }
+
+    unsigned long start = now_ns();
+    int ret = read_file(path, buf, size, offset, fi);
+    stats_end(ST_READ, start);
+    return ret;
+}
+
+int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    unsigned long start = now_ns();
+    int ret = write_file(path, buf, size, offset, (struct wfs_file *)(uintptr_t)fi->fh);
+    stats_end(ST_WRITE, start);
+    return ret;
+}
+
+int wfs_truncate(const char *path, off_t size) {
+    struct wfs_inode *inode;
+    if (is_stats_path(path)) {
+        return -EACCES;
+    }
+    begin_update();
+    pthread_rwlock_rdlock(&tree_lock);
+    int err = lookup_path(path, &inode);
+    if (err == 0) {
+        pthread_rwlock_wrlock(inode_lock(inode));
+        err = S_ISDIR(inode->mode) ? -EISDIR : set_size(inode, size);
+        pthread_rwlock_unlock(inode_lock(inode));
+    }
+    pthread_rwlock_unlock(&tree_lock);
+    end_update();
+    return err;
+}
+
+/*
+  Reserve zeroed blocks for [offset, offset + len). Blocks already mapped
+  are left as they are. Unless FALLOC_FL_KEEP_SIZE is given the file grows
+  to cover the range; with it, blocks past the end are kept until the file
+  is truncated.
+*/
+int wfs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
+    struct wfs_inode *inode;
+    (void)fi;
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        return -EOPNOTSUPP;
+    }
+    if (offset < 0 || len <= 0) {
+        return -EINVAL;
+    }
+    if (is_stats_path(path)) {
+        return -EACCES;
+    }
+    off_t end = offset + len;
+    if ((end + block_size - 1) / block_size > max_file_blocks()) {
+        return -EFBIG;
+    }
+
+    begin_update();
+    pthread_rwlock_rdlock(&tree_lock);
+    int err = lookup_path(path, &inode);
+    if (err == 0 && !S_ISREG(inode->mode)) {
+        err = S_ISDIR(inode->mode) ? -EISDIR : -ENODEV;
+    }
+    if (err < 0) {
+        pthread_rwlock_unlock(&tree_lock);
+        end_update();
+        return err;
+    }
+    pthread_rwlock_wrlock(inode_lock(inode));
+    if (inode->flags & WFS_INODE_INLINE) {
+        // A range that fits the inode slot is already there; anything bigger needs real blocks
+        if (end > (off_t)inline_capacity()) {
+            err = inline_to_blocks(inode);
+        } else if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->size) {
+            err = set_size(inode, end);
+        }
+        if (err < 0 || (inode->flags & WFS_INODE_INLINE)) {
+            goto out;
+        }
+    }
+
+    if ((err = preallocate(inode, offset / block_size, (end + block_size - 1) / block_size)) < 0) {
+        goto out;
+    }
+    if (end > inode->size) {
+        if (mode & FALLOC_FL_KEEP_SIZE) {
+            inode->flags |= WFS_INODE_PREALLOC;
+            inode->ctim = time(NULL);
+            mirror_range(inode, sizeof(*inode));
+        } else {
+            err = set_size(inode, end);
+        }
+    }
+out:
+    pthread_rwlock_unlock(inode_lock(inode));
+    pthread_rwlock_unlock(&tree_lock);
+    end_update();
+    return err;
+}
+
+int wfs_utimens(const char *path, const struct timespec tv[2]) {
+    struct wfs_inode *inode;
+    if (is_stats_path(path)) {
+        return -EPERM;
+    }
+    begin_update();
+    pthread_rwlock_rdlock(&tree_lock);
+    int err = lookup_path(path, &inode);
+    if (err == 0) {
+        pthread_rwlock_wrlock(inode_lock(inode));
+        inode->atim = tv ? tv[0].tv_sec : time(NULL);
+        inode->mtim = tv ? tv[1].tv_sec : time(NULL);
+        inode->ctim = time(NULL);
+        mirror_range(inode, sizeof(*inode));
+        pthread_rwlock_unlock(inode_lock(inode));
+    }
+    pthread_rwlock_unlock(&tree_lock);
+    end_update();
+    return err;
+}
+
+// Opening STATS_PATH takes a snapshot that every read through this handle sees
+int open_stats(struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EACCES;
+    }
+    struct wfs_file *file = calloc(1, sizeof(*file));
+    if (!file) {
+        return -ENOMEM;
+    }
+    long len = stats_format(&file->stats);
+    if (len < 0) {
+        free(file);
+        return len;
+    }
+    file->stats_len = len;
+    fi->fh = (uintptr_t)file;
+    fi->direct_io = 1; // The size changes between getattr and read
+    return 0;
+}
+
+int wfs_open(const char *path, struct fuse_file_info *fi) {
+    struct wfs_inode *inode;
+    if (is_stats_path(path)) {
+        return open_stats(fi);
+    }
+    pthread_rwlock_rdlock(&tree_lock);
+    int err = lookup_path(path, &inode);
+    pthread_rwlock_unlock(&tree_lock);
+    if (err < 0) {
+        return err;
+    }
+
+    struct wfs_file *file = calloc(1, sizeof(*file));
+    if (!file) {
+        return -ENOMEM;
+    }
+    file->ino = inode->num;
+    fi->fh = (uintptr_t)file;
+    return 0;
+}
+
+// Give back what speculative preallocation reserved past the end of the file
+void release_prealloc(const char *path, struct wfs_file *file) {
+    struct wfs_inode *inode;
+    begin_update();
+    pthread_rwlock_rdlock(&tree_lock);
+    // The path may name another file by now, or nothing at all
+    if (lookup_path(path, &inode) == 0 && inode->num == file->ino) {
+        pthread_rwlock_wrlock(inode_lock(inode));
+        trim_prealloc(inode);
+        pthread_rwlock_unlock(inode_lock(inode));
+    }
+    pthread_rwlock_unlock(&tree_lock);
+    end_update();
+}
+
+int wfs_release(const char *path, struct fuse_file_info *fi) {
+    struct wfs_file *file = (struct wfs_file *)(uintptr_t)fi->fh;
+    if (file && file->stats) {
+        free(file->stats);
+    } else if (file && file->speculated) {
+        release_prealloc(path, file);
+    }
+    free(file);
+    return 0;
+}
+
+int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void)path;
+    (void)datasync;
+    (void)fi;
+    unsigned long start = now_ns();
+    int err = 0;
+    if (journaled) {
+        // Whoever commits first carries every operation finished so far, fsyncs included
+        err = commit_metadata();
+    } else {
+        cache_flush();
+        for (int i = 0; i < num_disks; ++i) {
+            msync(disks[i].map, disks[i].size, MS_SYNC);
+        }
+    }
+    stats_end(ST_FSYNC, start);
+    return err;
+}
+
+/*
+  Directory offsets: 1 follows ".", 2 follows "..", and 3 + p follows the
+  entry that ends at byte p of the directory. A call resumes with the
+  first entry starting at or after the position its offset names and
+  stops once the kernel's buffer is full, so listing a big directory
+  costs one pass however many calls it takes. Entries never move within
+  their block, except that a hashed directory's leaf split moves some
+  names to the new block at the end: a listing in progress may then see
+  such a name twice, but never misses one.
+
+  This version of the FUSE API only passes the type and inode number of
+  each entry on to the kernel, which is enough for d_type, so tools such
+  as find can tell directories from files without a getattr per name.
+  Variable-length dentries store the type, so a listing never reads the
+  inodes; with fixed dentries it comes from the inode table.
+*/
+int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    struct wfs_inode *dir;
+    struct dir_entry e;
+    struct stat st;
+    char *block;
+    (void)fi;
+    unsigned long start = now_ns();
+    pthread_rwlock_rdlock(&tree_lock);
+    int err = lookup_path(path, &dir);
+    if (err == 0 && !S_ISDIR(dir->mode)) {
+        err = -ENOTDIR;
+    }
+    if (err == 0) {
+        if (offset < 1) {
+            fill_stat(dir, &st);
+            if (filler(buf, ".", &st, 1)) {
+                goto out;
+            }
+        }
+        if (offset < 2) {
+            // Leave ".." to the kernel's own idea of the parent; only its type matters here
+            memset(&st, 0, sizeof(st));
+            st.st_mode = S_IFDIR;
+            if (filler(buf, "..", &st, 2)) {
+                goto out;
+            }
+        }
+        off_t resume = offset > 3 ? offset - 3 : 0;
+        for (off_t lblk = resume / block_size; (block = dir_block(dir, lblk)); ++lblk) {
+            off_t base = lblk * block_size;
+            for (size_t pos = 0; dblk_next(block, &pos, &e);) {
+                if (base + (off_t)e.pos < resume) {
+                    continue;
+                }
+                char name[DIRENT_NAME_MAX + 1];
+                memcpy(name, e.name, e.len);
+                name[e.len] = '\0';
+                if (var_dentries) {
+                    memset(&st, 0, sizeof(st));
+                    st.st_ino = e.num;
+                    st.st_mode = DTTOIF(e.type);
+                } else {
+                    struct wfs_inode *inode = inode_at(e.num);
+                    pthread_rwlock_rdlock(inode_lock(inode));
+                    fill_stat(inode, &st);
+                    pthread_rwlock_unlock(inode_lock(inode));
+                }
+                if (filler(buf, name, &st, 3 + base + pos)) {
+                    goto out;
+                }
+            }
+        }
+    }
+out:
+    pthread_rwlock_unlock(&tree_lock);
+    stats_end(ST_READDIR, start);
+    return err;
+}
+
+// Write dirty cached data out, and commit the journal, every flush_interval seconds
+void *flusher_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        sleep(options.flush_interval);
+        if (journaled) {
+            commit_metadata();
+        } else {
+            cache_flush();
+        }
+    }
+    return NULL;
+}
+
+/*
+  Free inode and block counts. The bitmaps keep them exact in memory;
+  the superblock holds a copy that is only trusted if the last unmount
+  was clean. Mounting marks the copy stale, so after a crash the counts
+  are rebuilt from the bitmaps. With the journal the mark goes out with
+  the first commit: until then the disk still holds exactly the state
+  the stored counts describe. Data block checksums change outside the
+  journal, though, so with those the mark goes straight to the disks.
+*/
+int clean_mount; // The last unmount was clean
+void sync_superblock(void) {
+    for (int i = 0; i < num_disks; ++i) {
+        msync(disks[i].map, sizeof(struct wfs_sb), MS_SYNC);
+    }
+}
+
+void load_counts(void) {
+    if (sb->counts_valid && sb->free_inodes <= sb->num_inodes && sb->free_blocks <= sb->num_data_blocks) {
+        inode_map.free = sb->free_inodes;
+        data_map.free = sb->free_blocks;
+        clean_mount = 1;
+    } else {
+        inode_map.free = bitmap_count_free(&inode_map);
+        data_map.free = bitmap_count_free(&data_map);
+    }
+
+    sb->counts_valid = 0;
+    mirror_range(&sb->counts_valid, sizeof(sb->counts_valid));
+    if (journaled && (sb->features & WFS_FEATURE_CHECKSUMS)) {
+        for (int i = 0; i < num_disks; ++i) {
+            ((struct wfs_sb *)disks[i].map)->counts_valid = 0;
+        }
+    }
+    if (!journaled || (sb->features & WFS_FEATURE_CHECKSUMS)) {
+        sync_superblock();
+    }
+}
+
+void store_counts(void) {
+    sb->free_inodes = bitmap_free_bits(&inode_map);
+    sb->free_blocks = bitmap_free_bits(&data_map);
+    sb->counts_valid = 1;
+    mirror_range(&sb->free_inodes, offsetof(struct wfs_sb, counts_valid) + sizeof(sb->counts_valid) - offsetof(struct wfs_sb, free_inodes));
+}
+
+int wfs_statfs(const char *path, struct statvfs *st) {
+    (void)path;
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = block_size;
+    st->f_frsize = block_size;
+    st->f_blocks = sb->num_data_blocks;
+    st->f_bfree = st->f_bavail = bitmap_free_bits(&data_map);
+    st->f_files = sb->num_inodes;
+    st->f_ffree = st->f_favail = bitmap_free_bits(&inode_map);
+    st->f_namemax = name_max;
+    return 0;
+}
+
+/*
+  Online scrub for RAID 1. A background thread reads every disk in large
+  sequential windows and compares the copies of everything in use: the
+  bitmaps, allocated inode slots and allocated data blocks. Free space and
+  the journal are skipped; replay takes care of the latter. Copies caught
+  in the middle of a write can differ for a moment, so a mismatch is only
+  repaired if it survives a second look with every writer held off. The
+  copy that matches the block's checksum wins, and without checksums
+  the first disk's.
+
+  Reads are paced to options.scrub_kb, counting every copy read. The
+  position is saved in the superblock every SCRUB_SAVE bytes, so a pass
+  cut short by an unmount resumes where it stopped.
+*/
+#define SCRUB_WINDOW (1 << 20)  // Bytes read from each disk per step
+#define SCRUB_SAVE   (64 << 20) // Progress is recorded this often
+
+pthread_t scrub_thread;
+int scrub_started, scrub_stop;
+pthread_mutex_t scrub_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scrub_cond = PTHREAD_COND_INITIALIZER;
+
+// Sleep until `deadline` (CLOCK_REALTIME, in ns) or until told to stop; returns whether to stop
+int scrub_wait(unsigned long deadline) {
+    struct timespec ts = { .tv_sec = deadline / 1000000000, .tv_nsec = deadline % 1000000000 };
+    pthread_mutex_lock(&scrub_mutex);
+    while (!scrub_stop && pthread_cond_timedwait(&scrub_cond, &scrub_mutex, &ts) != ETIMEDOUT) {
+    }
+    int stop = scrub_stop;
+    pthread_mutex_unlock(&scrub_mutex);
+    return stop;
+}
+
+unsigned long realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Length of the piece at `pos` that is checked or skipped as a whole, and in *live whether to check it
+size_t scrub_piece(off_t pos, int *live) {
+    off_t inodes_end = sb->i_blocks_ptr + (off_t)(sb->num_inodes * sb->inode_size);
+    if (pos < sb->i_blocks_ptr) {
+        *live = 1; // The bitmaps
+        return sb->i_blocks_ptr - pos;
+    }
+    if (pos < inodes_end) {
+        off_t rel = pos - sb->i_blocks_ptr;
+        *live = bitmap_test(&inode_map, rel / sb->inode_size);
+        return sb->inode_size - rel % sb->inode_size;
+    }
+    off_t csums_end = sb->c_blocks_ptr + (off_t)(sb->num_data_blocks * sizeof(uint32_t));
+    if (checksums && pos >= sb->c_blocks_ptr && pos < csums_end) {
+        *live = 1; // The checksum table
+        return csums_end - pos;
+    }
+    if (pos < sb->d_blocks_ptr) {
+        *live = 0; // The journal
+        return (checksums && pos < sb->c_blocks_ptr ? sb->c_blocks_ptr : sb->d_blocks_ptr) - pos;
+    }
+    off_t rel = pos - sb->d_blocks_ptr;
+    *live = bitmap_test(&data_map, rel / block_size);
+    return block_size - rel % block_size;
+}
+
+// Make every mirror of [pos, pos + len) match the best copy, if they still differ with writers held off
+void scrub_repair(off_t pos, size_t len) {
+    if (journaled) {
+        // Commit first: afterwards no private view holds changes that would be written over the repair
+        pthread_rwlock_wrlock(&journal_lock);
+        commit_locked();
+    }
+    pthread_rwlock_wrlock(&tree_lock);
+    pthread_mutex_lock(&cache_lock);
+    int src = 0;
+    if (checksums && pos >= sb->d_blocks_ptr) {
+        src = csum_good_mirror(pos, 0);
+        src = src < 0 ? 0 : src;
+    }
+    for (int d = 0; d < num_disks; ++d) {
+        if (d != src && memcmp(disks[src].map + pos, disks[d].map + pos, len) != 0) {
+            memcpy(disks[d].map + pos, disks[src].map + pos, len);
+            stat_add(&scrub_stats.repaired, 1);
+            fprintf(stderr, "Scrub: repaired %zu bytes at %ld on disk %d.\n", len, (long)pos, d);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    pthread_rwlock_unlock(&tree_lock);
+    if (journaled) {
+        pthread_rwlock_unlock(&journal_lock);
+    }
+}
+
+// Compare the live pieces of [pos, end), already read from every disk into bufs; returns the bytes compared
+size_t scrub_compare(off_t pos, off_t end, char **bufs) {
+    size_t checked = 0;
+    for (off_t at = pos; at < end;) {
+        int live;
+        size_t len = scrub_piece(at, &live);
+        if (len > (size_t)(end - at)) {
+            len = end - at;
+        }
+        if (live) {
+            for (int d = 1; d < num_disks; ++d) {
+                if (memcmp(bufs[0] + (at - pos), bufs[d] + (at - pos), len) != 0) {
+                    stat_add(&scrub_stats.mismatches, 1);
+                    scrub_repair(at, len);
+                    break;
+                }
+            }
+            checked += len;
+        }
+        at += len;
+    }
+    return checked;
+}
+
+// Whether any piece of [pos, end) is in use
+int scrub_live(off_t pos, off_t end) {
+    for (off_t at = pos; at < end;) {
+        int live;
+        at += scrub_piece(at, &live);
+        if (live) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void scrub_save(off_t pos, int done) {
+    begin_update();
+    __atomic_store_n(&sb->scrub_pos, pos, __ATOMIC_RELAXED);
+    if (done) {
+        __atomic_store_n(&sb->scrub_done, time(NULL), __ATOMIC_RELAXED);
+    }
+    mirror_range(&sb->scrub_pos, offsetof(struct wfs_sb, scrub_done) + sizeof(sb->scrub_done) - offsetof(struct wfs_sb, scrub_pos));
+    end_update();
+    if (!journaled) {
+        sync_superblock();
+    }
+}
+
+void *scrub_main(void *arg) {
+    (void)arg;
+    off_t start = sb->i_bitmap_ptr;
+    off_t end = sb->d_blocks_ptr + (off_t)(sb->num_data_blocks * block_size);
+    char *bufs[MAX_DISKS];
+    for (int d = 0; d < num_disks; ++d) {
+        if (!(bufs[d] = malloc(SCRUB_WINDOW))) {
+            perror("Failed to allocate scrub buffer");
+            return NULL;
+        }
+    }
+
+    off_t pos = sb->scrub_pos;
+    if (pos < start || pos >= end) {
+        pos = start;
+    }
+    off_t saved = pos;
+    for (;;) {
+        while (pos < end) {
+            unsigned long began = realtime_ns();
+            off_t next = pos + SCRUB_WINDOW < end ? pos + SCRUB_WINDOW : end;
+            size_t len = next - pos;
+            if (scrub_live(pos, next)) {
+                int ok = 1;
+                for (int d = 0; d < num_disks && ok; ++d) {
+                    ok = pread(disks[d].fd, bufs[d], len, pos) == (ssize_t)len;
+                }
+                if (ok) {
+                    stat_add(&scrub_stats.bytes, scrub_compare(pos, next, bufs));
+                }
+                // Pace the reads, every copy counted
+                unsigned long budget = (unsigned long)len * num_disks * 1000000000UL / (options.scrub_kb * 1024);
+                if (scrub_wait(began + budget)) {
+                    goto out;
+                }
+            } else if (__atomic_load_n(&scrub_stop, __ATOMIC_RELAXED)) {
+                goto out;
+            }
+            pos = next;
+            if (pos - saved >= SCRUB_SAVE) {
+                scrub_save(pos, 0);
+                saved = pos;
+            }
+        }
+        stat_add(&scrub_stats.passes, 1);
+        scrub_save(0, 1);
+        pos = saved = start;
+        if (scrub_wait(realtime_ns() + options.scrub_interval * 1000000000UL)) {
+            break;
+        }
+    }
+out:
+    if (pos != start) {
+        scrub_save(pos, 0);
+    }
+    for (int d = 0; d < num_disks; ++d) {
+        free(bufs[d]);
+    }
+    return NULL;
+}
+
+void *wfs_init(struct fuse_conn_info *conn) {
+    (void)conn;
+    // Threads don't survive FUSE daemonizing, so start them only once it has
+    if (backend->run == mmap_run) {
+        start_io_workers();
+    }
+
+    pthread_t flusher;
+    if ((cache_capacity || journaled) && options.flush_interval) {
+        if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+            perror("Failed to start cache flusher");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(flusher);
+    }
+
+    if (sb->raid_mode == 1 && options.scrub_kb) {
+        if (pthread_create(&scrub_thread, NULL, scrub_main, NULL) != 0) {
+            perror("Failed to start scrub");
+            exit(EXIT_FAILURE);
+        }
+        scrub_started = 1;
+    }
+    return NULL;
+}
+
+void wfs_destroy(void *private_data) {
+    (void)private_data;
+    if (scrub_started) {
+        pthread_mutex_lock(&scrub_mutex);
+        __atomic_store_n(&scrub_stop, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&scrub_cond);
+        pthread_mutex_unlock(&scrub_mutex);
+        pthread_join(scrub_thread, NULL);
+    }
+    // The first commit releases the deferred frees, so the counts stored by the second are exact
+    if (journaled && commit_metadata() == 0) {
+        store_counts();
+        if (commit_metadata() == 0) {
+            journal_close();
+        }
+    }
+    cache_flush();
+    for (int i = 0; i < num_disks; ++i) {
+        msync(disks[i].map, disks[i].size, MS_SYNC);
+    }
+    if (!journaled) {
+        // Only once everything they count is on disk
+        store_counts();
+        sync_superblock();
+    }
+    for (int i = 0; i < num_disks; ++i) {
+        if (disks[i].meta != disks[i].map) {
+            munmap(disks[i].meta, disks[i].size);
+        }
+        munmap(disks[i].map, disks[i].size);
+        close(disks[i].fd);
+    }
+}
+
+struct fuse_operations ops = {
+    .getattr  = wfs_getattr,
+    .mknod    = wfs_mknod,
+    .mkdir    = wfs_mkdir,
+    .unlink   = wfs_unlink,
+    .rmdir    = wfs_rmdir,
+    .rename   = wfs_rename,
+    .open     = wfs_open,
+    .release  = wfs_release,
+    .fsync    = wfs_fsync,
+    .read     = wfs_read,
+    .write    = wfs_write,
+    .truncate = wfs_truncate,
+    .fallocate = wfs_fallocate,
+    .utimens  = wfs_utimens,
+    .readdir  = wfs_readdir,
+    .statfs   = wfs_statfs,
+    .init     = wfs_init,
+    .destroy  = wfs_destroy,
+};
+
+void map_disk(struct wfs_disk *disk, const char *path) {
+    struct stat st;
+
+    disk->fd = open(path, O_RDWR);
+    if (disk->fd < 0) {
+        perror("Failed to open disk image");
+        exit(EXIT_FAILURE);
+    }
+    if (fstat(disk->fd, &st) < 0) {
+        perror("Failed to get disk size");
+        exit(EXIT_FAILURE);
+    }
+    disk->size = st.st_size;
+    if (disk->size < sizeof(struct wfs_sb)) {
+        fprintf(stderr, "Error: %s is too small to hold a filesystem.\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    disk->map = mmap(NULL, disk->size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+    if (disk->map == MAP_FAILED) {
+        perror("Failed to map disk image");
+        exit(EXIT_FAILURE);
+    }
+    disk->meta = disk->map;
+}
+
+// Put the disks in array order using the position each superblock records
+void order_disks(void) {
+    struct wfs_disk ordered[MAX_DISKS] = {0};
+    struct wfs_sb *first = (struct wfs_sb *)disks[0].map;
+
+    if (first->num_disks != num_disks) {
+        fprintf(stderr, "Error: Filesystem spans %d disks but %d were given.\n", first->num_disks, num_disks);
+        exit(EXIT_FAILURE);
+    }
+    for (int d = 0; d < num_disks; ++d) {
+        struct wfs_sb *disk_sb = (struct wfs_sb *)disks[d].map;
+        int index = disk_sb->disk_index;
+        if (memcmp(disk_sb->uuid, first->uuid, sizeof(first->uuid)) != 0) {
+            fprintf(stderr, "Error: Disk images do not belong to the same filesystem.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (index < 0 || index >= num_disks || ordered[index].map) {
+            fprintf(stderr, "Error: Disk %d of the array is missing or given twice.\n", index);
+            exit(EXIT_FAILURE);
+        }
+        ordered[index] = disks[d];
+    }
+    memcpy(disks, ordered, sizeof(ordered));
+}
+
+/*
+  Whether two superblocks describe the same filesystem. Only the fields
+  mkfs sets for good are compared: the counts and the scrub position
+  change while the filesystem is in use, and disk_index differs anyway.
+*/
+int same_filesystem(const struct wfs_sb *a, const struct wfs_sb *b) {
+    return memcmp(a->uuid, b->uuid, sizeof(a->uuid)) == 0 &&
+           a->num_inodes == b->num_inodes && a->num_data_blocks == b->num_data_blocks &&
+           a->i_bitmap_ptr == b->i_bitmap_ptr && a->d_bitmap_ptr == b->d_bitmap_ptr &&
+           a->i_blocks_ptr == b->i_blocks_ptr && a->d_blocks_ptr == b->d_blocks_ptr &&
+           a->features == b->features && a->inode_size == b->inode_size &&
+           a->raid_mode == b->raid_mode && a->chunk_size == b->chunk_size &&
+           a->num_disks == b->num_disks && a->block_size == b->block_size &&
+           a->j_blocks_ptr == b->j_blocks_ptr && a->journal_size == b->journal_size &&
+           a->num_groups == b->num_groups && a->c_blocks_ptr == b->c_blocks_ptr;
+}
+
+// Replay what a crash left in the journals, then give every disk its private metadata view
+void start_journal(void) {
+    off_t inodes_end = sb->i_blocks_ptr + (off_t)(sb->num_inodes * sb->inode_size);
+    if (sb->j_blocks_ptr < inodes_end || sb->journal_size % JOURNAL_UNIT != 0 ||
+        sb->journal_size < 4 * JOURNAL_UNIT || sb->j_blocks_ptr + (off_t)sb->journal_size > sb->d_blocks_ptr) {
+        fprintf(stderr, "Error: Disk image does not hold a valid filesystem.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The first disk's journal goes last and onto every mirror, so that all copies agree
+    char *mirrors[MAX_DISKS];
+    for (int d = 1; d < num_disks; ++d) {
+        mirrors[d - 1] = disks[d].map;
+    }
+    off_t mirrored_end = sb->raid_mode == 1 ? sb->d_blocks_ptr + (off_t)(sb->num_data_blocks * block_size) : sb->d_blocks_ptr;
+    for (int d = num_disks - 1; d >= 0; --d) {
+        int replayed = journal_recover(disks[d].map, disks[d].size, sb->j_blocks_ptr, sb->journal_size,
+                                       mirrors, d == 0 ? num_disks - 1 : 0, mirrored_end);
+        if (replayed > 0) {
+            fprintf(stderr, "Replayed %d journal transactions on disk %d.\n", replayed, d);
+        }
+    }
+
+    int fds[MAX_DISKS];
+    char *views[MAX_DISKS];
+    size_t sizes[MAX_DISKS];
+    for (int d = 0; d < num_disks; ++d) {
+        disks[d].meta = mmap(NULL, disks[d].size, PROT_READ | PROT_WRITE, MAP_PRIVATE, disks[d].fd, 0);
+        if (disks[d].meta == MAP_FAILED) {
+            perror("Failed to map disk image");
+            exit(EXIT_FAILURE);
+        }
+        fds[d] = disks[d].fd;
+        views[d] = disks[d].meta;
+        sizes[d] = disks[d].size;
+    }
+    sb = (struct wfs_sb *)disks[0].meta;
+    journal_init(num_disks, fds, views, sizes, sb->j_blocks_ptr, sb->journal_size);
+    journaled = 1;
+}
+
+/*
+  Speculative preallocation is given back when the file's handle is
+  released. After a crash nothing will release it, so free whatever
+  files without WFS_INODE_PREALLOC map past their end.
+*/
+void trim_lost_prealloc(void) {
+    size_t before = bitmap_free_bits(&data_map) + num_pending;
+    for (size_t num = 0; num < sb->num_inodes; ++num) {
+        struct wfs_inode *inode = inode_at(num);
+        if (bitmap_test(&inode_map, num) && S_ISREG(inode->mode)) {
+            trim_prealloc(inode);
+        }
+    }
+    size_t freed = bitmap_free_bits(&data_map) + num_pending - before;
+    if (freed) {
+        fprintf(stderr, "Freed %zu preallocated blocks left past the end of files by an unclean shutdown.\n", freed);
+    }
+}
+
+/*
+  A data block and its checksum are written in place one after the other,
+  so after an unclean shutdown either may have reached the disks without
+  the other, on every mirror alike. Rather than fail such blocks with EIO
+  for good, recompute the checksum of every data block in use from what
+  it holds now, taking the first disk's copy on RAID 1. Damage from
+  before the crash goes unnoticed that way, and the mount reads all the
+  data in use.
+*/
+void rebuild_checksums(void) {
+    size_t rebuilt = 0;
+    for (size_t b = 0; b < sb->num_data_blocks; ++b) {
+        off_t off = sb->d_blocks_ptr + (off_t)b * block_size;
+        if (bitmap_test(&data_map, b) && *csum_entry(off) != CSUM_NONE) {
+            csum_update(off);
+            rebuilt++;
+        }
+    }
+    fprintf(stderr, "Rebuilt the checksums of %zu data blocks after an unclean shutdown.\n", rebuilt);
+}
+
+// Check where the checksum table is and get ready to compute checksums
+void setup_checksums(void) {
+    if (!(sb->features & WFS_FEATURE_CHECKSUMS)) {
+        return;
+    }
+    off_t itable_end = sb->i_blocks_ptr + (off_t)(sb->num_inodes * sb->inode_size);
+    if (sb->c_blocks_ptr < itable_end || sb->c_blocks_ptr < sb->j_blocks_ptr + (off_t)sb->journal_size ||
+        sb->c_blocks_ptr + (off_t)(sb->num_data_blocks * sizeof(uint32_t)) > sb->d_blocks_ptr) {
+        fprintf(stderr, "Error: Disk image does not hold a valid filesystem.\n");
+        exit(EXIT_FAILURE);
+    }
+    crc32c_init();
+    char zeros[BLOCK_SIZE] = {0};
+    for (size_t done = 0; done < block_size; done += sizeof(zeros)) {
+        zero_csum = crc32c(zero_csum, zeros, sizeof(zeros));
+    }
+    checksums = 1;
+    if (!clean_mount) {
+        rebuild_checksums();
+    }
+}
+
+// Work out the allocation group geometry from the superblock
+void setup_groups(void) {
+    if (sb->features & WFS_FEATURE_GROUPS) {
+        num_groups = sb->num_groups;
+        if (num_groups == 0 || num_groups > WFS_MAX_GROUPS ||
+            sb->num_inodes % (num_groups * GROUP_ALIGN) != 0 || sb->num_data_blocks % (num_groups * GROUP_ALIGN) != 0) {
+            fprintf(stderr, "Error: Disk image does not hold a valid filesystem.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    inodes_per_group = sb->num_inodes / num_groups;
+    blocks_per_group = sb->num_data_blocks / num_groups;
+}
+
+int main(int argc, char *argv[]) {
+    // Disk images come first; everything from the first option on is for FUSE
+    int i = 1;
+    while (i < argc - 1 && argv[i][0] != '-') {
+        if (num_disks >= MAX_DISKS) {
+            fprintf(stderr, "Too many disks specified (max: %d)\n", MAX_DISKS);
+            print_usage(argv[0]);
+        }
+        map_disk(&disks[num_disks++], argv[i++]);
+    }
+    if (num_disks < 2 || i >= argc) {
+        print_usage(argv[0]);
+    }
+
+    order_disks();
+    sb = (struct wfs_sb *)disks[0].map;
+    block_size = sb->block_size;
+    if (block_size < BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0 ||
+        sb->inode_size < sizeof(struct wfs_inode) || sb->inode_size > BLOCK_SIZE ||
+        (sb->raid_mode != 0 && sb->raid_mode != 1) ||
+        sb->chunk_size == 0 || sb->chunk_size % block_size != 0) {
+        fprintf(stderr, "Error: Disk image does not hold a valid filesystem.\n");
+        exit(EXIT_FAILURE);
+    }
+    var_dentries = (sb->features & WFS_FEATURE_VAR_DENTRIES) != 0;
+    name_max = MAX_NAME - 1;
+    if (var_dentries) {
+        /*
+          Splitting a hashed directory's leaf must always make room in the
+          end. A leaf down to one entry can still have a free first record
+          too small to reuse in front of it, so the longest record is kept
+          to a third of a block: 160-byte names with 512-byte blocks.
+        */
+        name_max = block_size / 3 / DIRENT_ALIGN * DIRENT_ALIGN - sizeof(struct wfs_dirent);
+        if (name_max > DIRENT_NAME_MAX) {
+            name_max = DIRENT_NAME_MAX;
+        }
+    }
+    size_t fs_size = sb->d_blocks_ptr + DISK_DATA_SIZE(sb);
+    for (int d = 0; d < num_disks; ++d) {
+        if (disks[d].size < fs_size) {
+            fprintf(stderr, "Error: Disk image does not hold a valid filesystem.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // A crash can leave the disks' superblocks a journal transaction apart, so replay first
+    if (sb->features & WFS_FEATURE_JOURNAL) {
+        start_journal();
+    }
+    for (int d = 1; d < num_disks; ++d) {
+        if (!same_filesystem((struct wfs_sb *)disks[d].map, (struct wfs_sb *)disks[0].map)) {
+            fprintf(stderr, "Error: Disk images do not belong to the same filesystem.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    bitmap_init(&inode_map, disks[0].meta + sb->i_bitmap_ptr, sb->num_inodes);
+    bitmap_init(&data_map, disks[0].meta + sb->d_bitmap_ptr, sb->num_data_blocks);
+    load_counts();
+    setup_groups();
+    if (!clean_mount) {
+        trim_lost_prealloc();
+    }
+    setup_checksums();
+    dcache_init(DCACHE_SIZE);
+    for (int j = 0; j < INODE_LOCKS; ++j) {
+        pthread_rwlock_init(&inode_locks[j], NULL);
+    }
+
+    // Hand the program name and the remaining arguments to FUSE, minus our own options
+    argv[i - 1] = argv[0];
+    struct fuse_args args = FUSE_ARGS_INIT(argc - i + 1, &argv[i - 1]);
+    if (fuse_opt_parse(&args, &options, wfs_opts, NULL) < 0) {
+        print_usage(argv[0]);
+    }
+    cache_init(options.cache_kb * 1024 / block_size);
+    clock_gettime(CLOCK_MONOTONIC, &mount_time);
+    if (select_backend(options.io) < 0) {
+        print_usage(argv[0]);
+    }
+
+    int ret = fuse_main(args.argc, args.argv, &ops, NULL);
+    fuse_opt_free_args(&args);
+    return ret;
+}
@@ -1,7 +1,9 @@
 #include <time.h>
+#include <stddef.h>
 #include <sys/stat.h>
 
-#define BLOCK_SIZE (512)
+#define BLOCK_SIZE (512)       /* Default and smallest block size, and the largest inode slot */
+#define MAX_BLOCK_SIZE (65536)
 #define MAX_NAME   (28)
 
 #define D_BLOCK    (6)
@@ -13,13 +15,20 @@
   `mkfs` writes the superblock to offset 0 of the disk image. 
   The disk image will have this format:
 
-          d_bitmap_ptr       d_blocks_ptr
-               v                  v
-+----+---------+---------+--------+--------------------------+
-| SB | IBITMAP | DBITMAP | INODES |       DATA BLOCKS        |
-+----+---------+---------+--------+--------------------------+
-0    ^                   ^
-i_bitmap_ptr        i_blocks_ptr
+          d_bitmap_ptr                  d_blocks_ptr
+               v                             v
++----+---------+---------+--------+---------+--------------------------+
+| SB | IBITMAP | DBITMAP | INODES | JOURNAL | CSUMS |   DATA BLOCKS    |
++----+---------+---------+--------+---------+-------+------------------+
+0    ^                   ^        ^         ^
+i_bitmap_ptr        i_blocks_ptr  j_blocks_ptr
+                                            c_blocks_ptr
+
+The journal is only present with WFS_FEATURE_JOURNAL, and the checksum
+table only with WFS_FEATURE_CHECKSUMS. Allocation groups
+(WFS_FEATURE_GROUPS) divide the inodes and data blocks without moving them.
+With RAID 1 every disk holds all the data blocks. RAID 0 deals them out
+chunk by chunk, so each disk holds only its share of the chunks.
 
 */
 
@@ -32,8 +41,62 @@ struct wfs_sb {
     off_t i_blocks_ptr;
     off_t d_blocks_ptr;
     // Extend after this line
+    unsigned int features; /* WFS_FEATURE_* flags chosen by mkfs */
+    size_t inode_size;     /* Bytes per slot in the inode table */
+    int raid_mode;         /* 0 = striping, 1 = mirroring */
+    size_t chunk_size;     /* RAID 0 stripe unit in bytes */
+    int num_disks;         /* Disks in the array */
+    int disk_index;        /* Position of this disk in the array, the only field that differs between disks */
+    unsigned char uuid[16]; /* Shared by every disk of one filesystem */
+    size_t block_size;     /* Bytes per data block, a power of two from BLOCK_SIZE to MAX_BLOCK_SIZE */
+    off_t j_blocks_ptr;    /* Start of the metadata journal */
+    size_t journal_size;   /* Bytes in the journal, a multiple of JOURNAL_UNIT */
+    size_t free_inodes;    /* Free inode and data block counts, exact only while counts_valid is set */
+    size_t free_blocks;
+    int counts_valid;      /* Cleared at mount and set again by a clean unmount */
+    size_t num_groups;     /* Allocation groups, with WFS_FEATURE_GROUPS */
+    off_t scrub_pos;       /* Where an interrupted RAID 1 scrub resumes, 0 to start a new pass */
+    time_t scrub_done;     /* When the last full scrub pass finished, 0 if none has */
+    off_t c_blocks_ptr;    /* Start of the data block checksum table */
 };
 
+// Bytes of the data region stored on each disk
+#define DISK_DATA_SIZE(sb) ((sb)->raid_mode == 0 ? \
+    ((sb)->num_data_blocks * (sb)->block_size + (sb)->chunk_size * (sb)->num_disks - 1) / ((sb)->chunk_size * (sb)->num_disks) * (sb)->chunk_size : \
+    (sb)->num_data_blocks * (sb)->block_size)
+
+// Superblock feature flags
+#define WFS_FEATURE_PACKED_INODES (1 << 0) /* Several inodes share each inode-table block */
+#define WFS_FEATURE_EXTENTS       (1 << 1) /* Inodes map their data with extent trees */
+#define WFS_FEATURE_DIR_INDEX     (1 << 2) /* Large directories carry a hash index */
+#define WFS_FEATURE_INLINE_DATA   (1 << 3) /* Tiny files keep their data in the inode slot */
+#define WFS_FEATURE_JOURNAL       (1 << 4) /* Metadata changes go through a write-ahead journal */
+#define WFS_FEATURE_LAZY_ITABLE   (1 << 5) /* mkfs left free inode slots unzeroed; the inode bitmap says which are live */
+#define WFS_FEATURE_GROUPS        (1 << 6) /* Inodes and data blocks are split into num_groups allocation groups */
+#define WFS_FEATURE_CHECKSUMS     (1 << 7) /* Every data block has a CRC32C in the checksum table */
+#define WFS_FEATURE_VAR_DENTRIES  (1 << 8) /* Directory entries are variable-length wfs_dirent records */
+
+/*
+  Allocation groups. Group g owns an equal slice of the inodes, starting
+  at inode g * (num_inodes / num_groups), and an equal slice of the data
+  blocks; its parts of the two bitmaps are the matching bit ranges. Both
+  slices are a multiple of 64 items, so no two groups share a 64-bit
+  chunk of either bitmap.
+*/
+#define WFS_MAX_GROUPS (256)
+#define GROUP_ALIGN    (64)
+
+/*
+  Checksums. Entry i of the table, a uint32_t at c_blocks_ptr + 4 * i, is
+  the CRC32C of data block i. Like the bitmaps the table is copied to
+  every disk. Entries of free blocks mean nothing; a block's entry is
+  written when it is allocated. Since groups are slices of the block
+  numbers, each group's checksums form a slice of the table too.
+  Directory, index and mapping blocks get CSUM_NONE, which checks
+  nothing; a data block whose CRC happens to be 0 goes unchecked as well.
+*/
+#define CSUM_NONE (0)
+
 // Inode
 struct wfs_inode {
     int     num;      /* Inode number */
@@ -42,6 +105,7 @@ struct wfs_inode {
     gid_t   gid;      /* Group ID of owner */
     off_t   size;     /* Total size, in bytes */
     int     nlinks;   /* Number of links */
+    int     flags;    /* WFS_INODE_* */
 
     time_t atim;      /* Time of last access */
     time_t mtim;      /* Time of last modification */
@@ -50,8 +114,142 @@ struct wfs_inode {
     off_t blocks[N_BLOCKS];
 };
 
+/*
+  Inode flags. An inline file keeps its data in its inode's slot of the
+  inode table, starting where blocks[] starts and running to the end of
+  the slot, instead of in data blocks. It moves out to data blocks for
+  good as soon as it outgrows the slot.
+
+  Blocks mapped past the end of a file are normally leftovers of the
+  daemon's speculative preallocation. They are freed when the file is
+  closed, or at the next mount if the daemon stopped first. A file
+  flagged WFS_INODE_PREALLOC had them reserved with fallocate(), so they
+  stay until the file is truncated.
+
+  A directory flagged WFS_INODE_INDEX has a hash index rooted in its
+  block 0. The flag is only used with variable-length dentries; fixed
+  dentries let the root's header identify it, see wfs_dx_header.
+*/
+#define WFS_INODE_INLINE   (1 << 0)
+#define WFS_INODE_PREALLOC (1 << 1)
+#define WFS_INODE_INDEX    (1 << 2)
+#define INLINE_DATA_OFFSET (offsetof(struct wfs_inode, blocks))
+
 // Directory entry
 struct wfs_dentry {
     char name[MAX_NAME];
     int num;
 };
+
+/*
+  With the variable-length dentries feature, a directory block holds a
+  chain of records instead of wfs_dentry slots: a wfs_dirent header, then
+  the name, padded to DIRENT_ALIGN bytes. Each record runs up to the next
+  one and the last up to the end of the block, so a record may have room
+  to spare after its name. A record with name_len 0 is free. Removing an
+  entry hands its space to the record before it, so only the first record
+  of a block is ever free. Names are not NUL-terminated, and are at most
+  DIRENT_NAME_MAX bytes long or, in blocks too small for three records of
+  that size, as long as three records still fit.
+*/
+struct wfs_dirent {
+    int num;                /* Inode number */
+    unsigned short rec_len; /* Length of the whole record in DIRENT_ALIGN-byte units, so one can span 64 KB */
+    unsigned char name_len; /* Bytes in the name, 0 for a free record */
+    unsigned char type;     /* File type as in d_type: the S_IFMT bits of the mode >> 12 */
+    char name[];
+};
+
+#define DIRENT_ALIGN    (4)
+#define DIRENT_NAME_MAX (255)
+#define DIRENT_LEN(name_len) ((sizeof(struct wfs_dirent) + (name_len) + DIRENT_ALIGN - 1) / DIRENT_ALIGN * DIRENT_ALIGN)
+
+// With packed inodes, each slot is an inode padded to a whole number of cache lines
+#define CACHE_LINE (64)
+#define PACKED_INODE_SIZE ((sizeof(struct wfs_inode) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
+
+/*
+  With the extents feature, the blocks[] area of every inode holds the
+  root of an extent tree instead of block pointers: a header followed by
+  EXTENTS_IN_INODE entries. In a leaf (depth 0) each entry maps a run of
+  physically contiguous blocks. In an index node each entry points to
+  the child block that maps file blocks from `lblk` up to the next
+  entry's `lblk`. Child blocks hold a header and EXTENTS_IN_BLOCK entries.
+  An all-zero root is an empty tree.
+*/
+struct wfs_extent_header {
+    unsigned short entries; /* Entries in use */
+    unsigned short depth;   /* Levels below this node, 0 for a leaf */
+    unsigned int reserved;
+};
+
+struct wfs_extent {
+    unsigned int lblk; /* First file block covered */
+    unsigned int len;  /* Blocks in the run, unused in index nodes */
+    off_t start;       /* Disk offset of the run, or of the child node */
+};
+
+#define EXTENTS_IN_INODE ((sizeof(((struct wfs_inode *)0)->blocks) - sizeof(struct wfs_extent_header)) / sizeof(struct wfs_extent))
+#define EXTENTS_IN_BLOCK(bs) (((bs) - sizeof(struct wfs_extent_header)) / sizeof(struct wfs_extent))
+
+/*
+  With the dir-index feature, a directory whose first block fills up gets
+  a hash index: block 0 becomes the index root, and the index points to
+  leaf blocks of ordinary dentries. Each index block starts with a header
+  the size of one dentry. The header reads as a free dentry whose `num`
+  is WFS_DX_MAGIC, which is how index blocks are told apart from leaves.
+  With variable-length dentries the header instead starts with a free
+  record covering the whole block, so scans of the leaves pass over index
+  blocks, and the directory's WFS_INODE_INDEX flag marks the root.
+*/
+#define WFS_DX_MAGIC (-0x5844) /* Never a valid inode number */
+
+struct wfs_dx_header {
+    char unused;           /* Always 0, like a free dentry's name */
+    unsigned char levels;  /* In the root: index levels below it */
+    unsigned short count;  /* Entries in use */
+    unsigned short rec_len; /* With variable-length dentries, as in wfs_dirent: the whole block */
+    unsigned char name_len; /* With variable-length dentries, always 0 */
+    unsigned char type;
+    char pad[MAX_NAME - 8];
+    int magic;             /* WFS_DX_MAGIC where a dentry keeps its inode number */
+};
+
+// Covers names hashing to `hash` and above, up to the next entry's hash
+struct wfs_dx_entry {
+    unsigned int hash;
+    unsigned int block;    /* Logical block of the child within the directory */
+};
+
+#define DX_ENTRIES_PER_BLOCK(bs) (((bs) - sizeof(struct wfs_dx_header)) / sizeof(struct wfs_dx_entry))
+
+/*
+  With the journal feature, metadata (the superblock, bitmaps, inodes and
+  the directory, index and mapping blocks in the data region) reaches its
+  home location only after it has been logged. Changes are logged in
+  JOURNAL_UNIT-sized pieces, grouped into transactions. A transaction is
+  one contiguous run in the journal: a descriptor, which is a header
+  followed by the home offset of every unit and padded to whole units,
+  and then the image of each unit in the same order. The checksum makes a
+  transaction torn by a crash recognizable. Each disk logs the units it
+  holds into its own copy of the journal.
+
+  The disks take a transaction one after another, and the first disk's
+  journal is cleared only once every disk has the transaction home.
+  Recovery replays the first disk's journal onto every disk, so after a
+  crash all copies of the mirrored metadata agree. Two cases are weaker.
+  A transaction too large for the journal goes in as several pieces, and
+  the copies then agree only about the last piece. The striped blocks of
+  a RAID 0 array come from their own disk's journal only, so a
+  transaction is all or nothing on each disk but not across disks.
+*/
+#define JOURNAL_UNIT (512)
+#define WFS_JOURNAL_MAGIC (0x4c4e524a)
+
+struct wfs_journal_header {
+    unsigned int magic;    /* WFS_JOURNAL_MAGIC */
+    unsigned int count;    /* Units in the transaction */
+    unsigned long seq;     /* One more than the previous transaction's */
+    unsigned int checksum; /* FNV-1a over seq, count, the offsets and the images */
+    unsigned int reserved;
+};